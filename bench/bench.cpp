@@ -0,0 +1,336 @@
+// BENCHMARK DRIVER
+// -Standalone benchmark of MySearchTree, built and run by `make bench` (arguments go in BENCH_ARGS)
+// -Every run is one structure, one workload and one size. The workload's key stream is inserted, then
+//      the tree is balanced, then every live key is looked up with contains, rank and size, and
+//      finally removed again. Lookups and removes follow the stream's own order, so a sorted workload
+//      probes sequentially and a zipf one keeps hitting its hot keys
+// -Structures:
+//      tree        MySearchTree as it comes, no auto balancing. Sorted streams make it too deep, which
+//                  is reported as a failed run
+//      tree-auto   MySearchTree with setAutoBalance(0.75)
+//      set         std::set baseline. It has no rank, size or balance, so those rows are skipped
+// -Each row reports throughput, latency percentiles of the sampled calls (see harness.h) and the peak
+//      RSS of the run. --csv prints the same rows as CSV
+// -Each row also reports hardware counters per operation (per key for balance): instructions, cycles,
+//      L1d, LLC and dTLB misses and branch mispredicts (see perfcounters.h). Counters the machine
+//      doesn't offer show as "-", or as empty fields in CSV. --no-counters skips them altogether
+//
+// Usage: bench [--sizes 1000,1000000] [--full] [--workloads random,zipf] [--structures tree,set]
+//              [--seed N] [--csv] [--no-counters]
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../tree.h"
+#include "harness.h"
+
+namespace
+{
+    // results land here so the compiler can't drop the lookups
+    volatile std::size_t g_sink = 0;
+
+    struct Options
+    {
+        Options(): m_seed(42), m_csv(false), m_counters(true)
+        {
+            m_sizes = {1000, 10000, 100000, 1000000};
+            m_workloads = {"random", "sorted", "reverse", "zipf", "window"};
+            m_structures = {"tree", "tree-auto", "set"};
+        }
+
+        std::vector<std::size_t> m_sizes;
+        std::vector<std::string> m_workloads;
+        std::vector<std::string> m_structures;
+        std::uint64_t m_seed;
+        bool m_csv;
+        bool m_counters;
+    };
+
+    struct TreeAdapter
+    {
+        static const bool HAS_ORDER = true;
+
+        explicit TreeAdapter(double alpha)
+        {
+            m_tree.setAutoBalance(alpha);
+        }
+
+        void insert(BenchKey key) { g_sink += m_tree.insert(key); }
+        void remove(BenchKey key) { g_sink += m_tree.remove(key); }
+        void contains(BenchKey key) { g_sink += m_tree.contains(key); }
+        void rank(BenchKey key) { g_sink += m_tree.rank(key); }
+        void size(BenchKey key) { g_sink += m_tree.size(key); }
+        void balance() { g_sink += m_tree.balance(); }
+
+        MySearchTree<BenchKey> m_tree;
+    };
+
+    struct SetAdapter
+    {
+        static const bool HAS_ORDER = false;
+
+        void insert(BenchKey key) { g_sink += m_set.insert(key).second; }
+        void remove(BenchKey key) { g_sink += m_set.erase(key); }
+        void contains(BenchKey key) { g_sink += m_set.count(key); }
+        void rank(BenchKey) {}
+        void size(BenchKey) {}
+        void balance() {}
+
+        std::set<BenchKey> m_set;
+    };
+
+    void printHeader(const Options& options)
+    {
+        if (options.m_csv)
+        {
+            std::printf("structure,workload,n,op,ops,seconds,ops_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,max_ns,peak_rss_mb");
+            for (int event = 0; event < NUM_PERF_EVENTS; ++event)
+            {
+                std::printf(",%s_per_op", PerfCounters::name(static_cast<PerfEvent>(event)));
+            }
+        }
+        else
+        {
+            std::printf("%-10s %-8s %10s %-14s %12s %8s %8s %8s %9s %10s %9s", "structure", "workload", "n", "op",
+                        "ops/s", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns", "peak MB");
+            for (int event = 0; event < NUM_PERF_EVENTS; ++event)
+            {
+                std::printf(" %12s", (std::string(PerfCounters::name(static_cast<PerfEvent>(event))) + "/op").c_str());
+            }
+        }
+        std::printf("\n");
+    }
+
+    void printRow(const Options& options, const std::string& structure, const std::string& workload, std::size_t n,
+                  const std::string& op, const PhaseResult& result, std::size_t peakBytes)
+    {
+        double opsPerSec = (result.m_seconds > 0) ? result.m_numOps / result.m_seconds : 0;
+        double peakMb = peakBytes / (1024.0 * 1024.0);
+        const std::vector<std::uint64_t>& samples = result.m_samples;
+        if (options.m_csv)
+        {
+            std::printf("%s,%s,%zu,%s,%zu,%.6f,%.0f,%llu,%llu,%llu,%llu,%llu,%.1f", structure.c_str(), workload.c_str(),
+                        n, op.c_str(), result.m_numOps, result.m_seconds, opsPerSec,
+                        (unsigned long long) percentile(samples, 0.5), (unsigned long long) percentile(samples, 0.9),
+                        (unsigned long long) percentile(samples, 0.99), (unsigned long long) percentile(samples, 0.999),
+                        (unsigned long long) percentile(samples, 1.0), peakMb);
+            for (int event = 0; event < NUM_PERF_EVENTS; ++event)
+            {
+                double count = result.m_perf.m_counts[event];
+                if (count >= 0 && result.m_numOps > 0)
+                {
+                    std::printf(",%.3f", count / result.m_numOps);
+                }
+                else
+                {
+                    std::printf(",");
+                }
+            }
+        }
+        else
+        {
+            std::printf("%-10s %-8s %10zu %-14s %12.0f %8llu %8llu %8llu %9llu %10llu %9.1f", structure.c_str(),
+                        workload.c_str(), n, op.c_str(), opsPerSec,
+                        (unsigned long long) percentile(samples, 0.5), (unsigned long long) percentile(samples, 0.9),
+                        (unsigned long long) percentile(samples, 0.99), (unsigned long long) percentile(samples, 0.999),
+                        (unsigned long long) percentile(samples, 1.0), peakMb);
+            for (int event = 0; event < NUM_PERF_EVENTS; ++event)
+            {
+                double count = result.m_perf.m_counts[event];
+                if (count >= 0 && result.m_numOps > 0)
+                {
+                    std::printf(" %12.2f", count / result.m_numOps);
+                }
+                else
+                {
+                    std::printf(" %12s", "-");
+                }
+            }
+        }
+        std::printf("\n");
+        std::fflush(stdout);
+    }
+
+    // one structure, one workload, one size
+    template<typename Adapter>
+    void runOne(const Options& options, const std::string& structure, Adapter& subject, const std::string& workload,
+                const std::vector<BenchKey>& stream, PerfCounters* counters)
+    {
+        std::size_t n = stream.size();
+        std::vector<std::pair<std::string, PhaseResult> > rows;
+
+        // the window workload expires the oldest key once the window is full, as part of each insert
+        bool window = (workload == "window");
+        std::size_t width = windowSize(n);
+        rows.emplace_back(window ? "insert+expire" : "insert", runPhase(n, [&](std::size_t ii)
+        {
+            subject.insert(stream[ii]);
+            if (window && ii >= width)
+            {
+                subject.remove(stream[ii - width]);
+            }
+        }, counters));
+
+        std::vector<BenchKey> live(window ? stream.end() - std::min(width, n) : stream.begin(), stream.end());
+        if (Adapter::HAS_ORDER)
+        {
+            PhaseResult balanced = runPhase(1, [&](std::size_t) { subject.balance(); }, counters);
+            balanced.m_numOps = live.size(); // reported as keys per second
+            rows.emplace_back("balance", balanced);
+        }
+        rows.emplace_back("contains", runPhase(live.size(), [&](std::size_t ii) { subject.contains(live[ii]); }, counters));
+        if (Adapter::HAS_ORDER)
+        {
+            rows.emplace_back("rank", runPhase(live.size(), [&](std::size_t ii) { subject.rank(live[ii]); }, counters));
+            rows.emplace_back("size", runPhase(live.size(), [&](std::size_t ii) { subject.size(live[ii]); }, counters));
+        }
+        rows.emplace_back("remove", runPhase(live.size(), [&](std::size_t ii) { subject.remove(live[ii]); }, counters));
+
+        std::size_t peak = peakRss();
+        for (const auto& row : rows)
+        {
+            printRow(options, structure, workload, n, row.first, row.second, peak);
+        }
+    }
+
+    void run(const Options& options, const std::string& structure, const std::string& workload, std::size_t n,
+             PerfCounters* counters)
+    {
+        std::vector<BenchKey> stream = makeStream(workload, n, options.m_seed);
+        resetPeakRss();
+        try
+        {
+            if (structure == "set")
+            {
+                SetAdapter subject;
+                runOne(options, structure, subject, workload, stream, counters);
+            }
+            else
+            {
+                TreeAdapter subject(structure == "tree-auto" ? 0.75 : 0);
+                runOne(options, structure, subject, workload, stream, counters);
+            }
+        }
+        catch (const std::exception& error)
+        {
+            if (options.m_csv)
+            {
+                std::printf("%s,%s,%zu,failed,,,,,,,,,%s\n", structure.c_str(), workload.c_str(), n,
+                            std::string(NUM_PERF_EVENTS, ',').c_str());
+            }
+            else
+            {
+                std::printf("%-10s %-8s %10zu failed: %s\n", structure.c_str(), workload.c_str(), n, error.what());
+            }
+        }
+    }
+
+    std::vector<std::string> splitList(const std::string& list)
+    {
+        std::vector<std::string> items;
+        std::stringstream stream(list);
+        std::string item;
+        while (std::getline(stream, item, ','))
+        {
+            items.push_back(item);
+        }
+        return items;
+    }
+
+    Options parseOptions(int argc, char** argv)
+    {
+        Options options;
+        for (int ii = 1; ii < argc; ++ii)
+        {
+            std::string arg = argv[ii];
+            bool hasValue = (ii + 1 < argc);
+            if (arg == "--sizes" && hasValue)
+            {
+                options.m_sizes.clear();
+                for (const std::string& size : splitList(argv[++ii]))
+                {
+                    options.m_sizes.push_back(std::stoull(size));
+                }
+            }
+            else if (arg == "--full")
+            {
+                options.m_sizes = {1000, 10000, 100000, 1000000, 10000000, 100000000};
+            }
+            else if (arg == "--workloads" && hasValue)
+            {
+                options.m_workloads = splitList(argv[++ii]);
+            }
+            else if (arg == "--structures" && hasValue)
+            {
+                options.m_structures = splitList(argv[++ii]);
+            }
+            else if (arg == "--seed" && hasValue)
+            {
+                options.m_seed = std::stoull(argv[++ii]);
+            }
+            else if (arg == "--csv")
+            {
+                options.m_csv = true;
+            }
+            else if (arg == "--no-counters")
+            {
+                options.m_counters = false;
+            }
+            else
+            {
+                throw std::invalid_argument( "Unknown or incomplete option " + arg );
+            }
+        }
+        for (const std::string& workload : options.m_workloads)
+        {
+            makeStream(workload, 0, 0); // throws for names it doesn't know
+        }
+        for (const std::string& structure : options.m_structures)
+        {
+            if (structure != "tree" && structure != "tree-auto" && structure != "set")
+            {
+                throw std::invalid_argument( "Unknown structure " + structure );
+            }
+        }
+        return options;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    try
+    {
+        options = parseOptions(argc, argv);
+    }
+    catch (const std::exception& error)
+    {
+        std::cerr << error.what() << std::endl;
+        std::cerr << "Usage: bench [--sizes 1000,1000000] [--full] [--workloads random,sorted,reverse,zipf,window]"
+                  << " [--structures tree,tree-auto,set] [--seed N] [--csv] [--no-counters]" << std::endl;
+        return 1;
+    }
+
+    PerfCounters counters(options.m_counters);
+    if (options.m_counters && !counters.anyAvailable())
+    {
+        std::cerr << "Hardware counters are unavailable here (perf_event_open failed), reporting timings only" << std::endl;
+    }
+    PerfCounters* phaseCounters = counters.anyAvailable() ? &counters : nullptr;
+
+    printHeader(options);
+    for (std::size_t n : options.m_sizes)
+    {
+        for (const std::string& workload : options.m_workloads)
+        {
+            for (const std::string& structure : options.m_structures)
+            {
+                run(options, structure, workload, n, phaseCounters);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,256 @@
+// BENCHMARK HARNESS
+// -Timing, latency percentiles, memory and key stream generation for bench.cpp. Depends on nothing
+//      outside this repo
+// -A phase runs one operation count times back to back. Throughput is taken over the whole phase;
+//      latency is sampled by timing every SAMPLE_EVERY-th call on its own, so the clock reads don't
+//      swamp operations that only take tens of nanoseconds
+// -Given a PerfCounters, runPhase also reads the hardware counters around the loop (see perfcounters.h)
+// -Peak RSS is the kernel's high water mark (VmHWM). It is reset before each run where the kernel
+//      allows it (/proc/self/clear_refs), otherwise it is the peak of the whole process so far
+//
+// Functions
+//    1) runPhase (throughput and latency samples of one operation)
+//    2) percentile
+//    3) resetPeakRss / currentRss / peakRss
+//    4) makeStream (random, sorted, reverse, zipf and window key streams)
+#ifndef __BENCH_HARNESS__
+#define __BENCH_HARNESS__
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "perfcounters.h"
+
+typedef long long BenchKey;
+
+// one in this many calls is timed individually for the latency percentiles
+static const std::size_t SAMPLE_EVERY = 8;
+
+struct PhaseResult
+{
+    PhaseResult(): m_numOps(0), m_seconds(0) {}
+
+    std::size_t m_numOps;
+    double m_seconds;
+    std::vector<std::uint64_t> m_samples; // nanoseconds, sorted
+    PerfReading m_perf; // whole phase
+};
+
+inline std::uint64_t nowNanos()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// calls op(ii) for every ii in [0, count). counters may be null
+template<typename Op>
+PhaseResult runPhase(std::size_t count, Op op, PerfCounters* counters = nullptr)
+{
+    PhaseResult result;
+    result.m_numOps = count;
+    result.m_samples.reserve(count / SAMPLE_EVERY + 1);
+
+    if (counters != nullptr)
+    {
+        counters->start();
+    }
+    std::uint64_t start = nowNanos();
+    for (std::size_t ii = 0; ii < count; ++ii)
+    {
+        if (ii % SAMPLE_EVERY == 0)
+        {
+            std::uint64_t before = nowNanos();
+            op(ii);
+            result.m_samples.push_back(nowNanos() - before);
+        }
+        else
+        {
+            op(ii);
+        }
+    }
+    result.m_seconds = (nowNanos() - start) * 1e-9;
+    if (counters != nullptr)
+    {
+        result.m_perf = counters->stop();
+    }
+
+    std::sort(result.m_samples.begin(), result.m_samples.end());
+    return result;
+}
+
+// fraction is in [0, 1]; samples must be sorted
+inline std::uint64_t percentile(const std::vector<std::uint64_t>& samples, double fraction)
+{
+    if (samples.empty())
+    {
+        return 0;
+    }
+    std::size_t index = static_cast<std::size_t>(std::ceil(fraction * samples.size()));
+    return samples[(index == 0) ? 0 : std::min(index, samples.size()) - 1];
+}
+
+// reads a "Name:   1234 kB" line from /proc/self/status, in bytes. 0 if it isn't there
+inline std::size_t procStatus(const std::string& name)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, name.size() + 1, name + ":") == 0)
+        {
+            return std::stoull(line.substr(name.size() + 1)) * 1024;
+        }
+    }
+    return 0;
+}
+
+// Starts a new peak RSS measurement. Returns false if the kernel doesn't support that, in which case
+// peakRss() keeps reporting the peak since the process started
+inline bool resetPeakRss()
+{
+    std::ofstream clear("/proc/self/clear_refs");
+    clear << "5";
+    clear.flush();
+    return clear.good();
+}
+
+inline std::size_t currentRss()
+{
+    return procStatus("VmRSS");
+}
+
+inline std::size_t peakRss()
+{
+    std::size_t peak = procStatus("VmHWM");
+    if (peak == 0)
+    {
+        struct rusage usage;
+        ::getrusage(RUSAGE_SELF, &usage);
+        peak = static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+    }
+    return peak;
+}
+
+// Zipf distributed ranks in [0, n) with exponent theta (< 1), using the constant time method from
+// Gray et al., "Quickly generating billion-record synthetic databases". Setting it up is O(n)
+class ZipfGenerator
+{
+public:
+    ZipfGenerator(std::size_t n, double theta): m_n(n), m_theta(theta)
+    {
+        double zetaN = 0;
+        for (std::size_t ii = 1; ii <= n; ++ii)
+        {
+            zetaN += 1.0 / std::pow(static_cast<double>(ii), theta);
+        }
+        double zeta2 = 1.0 + 1.0 / std::pow(2.0, theta);
+        m_alpha = 1.0 / (1.0 - theta);
+        m_zetaN = zetaN;
+        m_eta = (1.0 - std::pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetaN);
+    }
+
+    template<typename Random>
+    std::size_t operator()(Random& random)
+    {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+        double uz = u * m_zetaN;
+        if (uz < 1.0)
+        {
+            return 0;
+        }
+        if (uz < 1.0 + std::pow(0.5, m_theta))
+        {
+            return 1;
+        }
+        std::size_t rank = static_cast<std::size_t>(m_n * std::pow(m_eta * u - m_eta + 1.0, m_alpha));
+        return std::min(rank, m_n - 1);
+    }
+
+private:
+    std::size_t m_n;
+    double m_theta;
+    double m_alpha;
+    double m_zetaN;
+    double m_eta;
+};
+
+// spreads ranks over the key space so that hot keys aren't also neighbours (a bijection on 64 bits)
+inline BenchKey scrambleKey(std::uint64_t rank)
+{
+    rank ^= rank >> 33;
+    rank *= 0xff51afd7ed558ccdULL;
+    rank ^= rank >> 33;
+    return static_cast<BenchKey>(rank >> 1);
+}
+
+// How many of the most recent keys a window stream keeps alive
+inline std::size_t windowSize(std::size_t n)
+{
+    return std::max<std::size_t>(1, std::min<std::size_t>(n / 4, 1 << 16));
+}
+
+// n keys in the order a workload produces them:
+//    random   distinct keys in random order
+//    sorted   ascending, eg. auto-increment ids
+//    reverse  descending
+//    zipf     drawn with Zipf skew (theta 0.99) from n distinct keys, so hot keys repeat
+//    window   roughly ascending timestamps with jitter; the benchmark keeps only the newest
+//             windowSize(n) of them, expiring older ones as it goes
+inline std::vector<BenchKey> makeStream(const std::string& workload, std::size_t n, std::uint64_t seed)
+{
+    std::mt19937_64 random(seed);
+    std::vector<BenchKey> keys(n);
+    if (workload == "random")
+    {
+        for (std::size_t ii = 0; ii < n; ++ii)
+        {
+            keys[ii] = scrambleKey(ii);
+        }
+        std::shuffle(keys.begin(), keys.end(), random);
+    }
+    else if (workload == "sorted" || workload == "reverse")
+    {
+        for (std::size_t ii = 0; ii < n; ++ii)
+        {
+            keys[ii] = static_cast<BenchKey>(ii) * 2;
+        }
+        if (workload == "reverse")
+        {
+            std::reverse(keys.begin(), keys.end());
+        }
+    }
+    else if (workload == "zipf")
+    {
+        ZipfGenerator zipf(n, 0.99);
+        for (std::size_t ii = 0; ii < n; ++ii)
+        {
+            keys[ii] = scrambleKey(zipf(random));
+        }
+    }
+    else if (workload == "window")
+    {
+        // each key arrives up to 63 ticks late; the low bits keep them unique
+        std::uniform_int_distribution<BenchKey> jitter(0, 63);
+        for (std::size_t ii = 0; ii < n; ++ii)
+        {
+            keys[ii] = (static_cast<BenchKey>(ii) + jitter(random)) * 64 + static_cast<BenchKey>(ii % 64);
+        }
+    }
+    else
+    {
+        throw std::invalid_argument( "Unknown workload " + workload );
+    }
+    return keys;
+}
+
+#endif
@@ -0,0 +1,198 @@
+// PERF COUNTERS
+// -Hardware performance counters for the benchmark phases, read through perf_event_open(2)
+// -Counts instructions, cycles, L1 data cache read misses, last level cache read misses, data TLB read
+//      misses and branch mispredicts, for this thread in user space only
+// -Every event is opened on its own, so a CPU (or VM) that lacks some of them still reports the rest.
+//      Events that can't be opened at all (no PMU, perf_event_paranoid too strict, seccomp) are just
+//      reported as unavailable; nothing fails because of them
+// -When there are more events than hardware counters the kernel multiplexes them, and the counts are
+//      scaled up by enabled / running time
+//
+// Functions
+//    1) start / stop
+//    2) available / name
+#ifndef __BENCH_PERF_COUNTERS__
+#define __BENCH_PERF_COUNTERS__
+
+#include <cstdint>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum PerfEvent
+{
+    PERF_INSTRUCTIONS,
+    PERF_CYCLES,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_BRANCH_MISSES,
+    NUM_PERF_EVENTS
+};
+
+// counts of one measured phase. A negative count means the event isn't available
+struct PerfReading
+{
+    PerfReading()
+    {
+        for (int ii = 0; ii < NUM_PERF_EVENTS; ++ii)
+        {
+            m_counts[ii] = -1;
+        }
+    }
+
+    double m_counts[NUM_PERF_EVENTS];
+};
+
+class PerfCounters
+{
+public:
+    // opens every event it can. enabled = false opens none, eg. for a --no-counters option
+    explicit PerfCounters(bool enabled = true)
+    {
+        for (int ii = 0; ii < NUM_PERF_EVENTS; ++ii)
+        {
+            m_fds[ii] = enabled ? openEvent(static_cast<PerfEvent>(ii)) : -1;
+        }
+    }
+
+    ~PerfCounters()
+    {
+        for (int ii = 0; ii < NUM_PERF_EVENTS; ++ii)
+        {
+            if (m_fds[ii] >= 0)
+            {
+                ::close(m_fds[ii]);
+            }
+        }
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available(PerfEvent event) const
+    {
+        return m_fds[event] >= 0;
+    }
+
+    // true if at least one event could be opened
+    bool anyAvailable() const
+    {
+        for (int ii = 0; ii < NUM_PERF_EVENTS; ++ii)
+        {
+            if (m_fds[ii] >= 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static const char* name(PerfEvent event)
+    {
+        static const char* const NAMES[NUM_PERF_EVENTS] = {"instr", "cycles", "L1d-miss", "LLC-miss", "dTLB-miss", "br-miss"};
+        return NAMES[event];
+    }
+
+    void start()
+    {
+        for (int ii = 0; ii < NUM_PERF_EVENTS; ++ii)
+        {
+            if (m_fds[ii] >= 0)
+            {
+                ::ioctl(m_fds[ii], PERF_EVENT_IOC_RESET, 0);
+                ::ioctl(m_fds[ii], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    PerfReading stop()
+    {
+        for (int ii = 0; ii < NUM_PERF_EVENTS; ++ii)
+        {
+            if (m_fds[ii] >= 0)
+            {
+                ::ioctl(m_fds[ii], PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+
+        PerfReading reading;
+        for (int ii = 0; ii < NUM_PERF_EVENTS; ++ii)
+        {
+            // value, time enabled, time running (PERF_FORMAT_TOTAL_TIME_*)
+            std::uint64_t values[3];
+            if (m_fds[ii] < 0 || ::read(m_fds[ii], values, sizeof(values)) != sizeof(values))
+            {
+                continue;
+            }
+            if (values[2] == 0)
+            {
+                reading.m_counts[ii] = (values[1] == 0) ? 0 : -1; // never got a counter
+            }
+            else
+            {
+                reading.m_counts[ii] = static_cast<double>(values[0]) * values[1] / values[2];
+            }
+        }
+        return reading;
+    }
+
+private:
+    int m_fds[NUM_PERF_EVENTS];
+
+    static std::uint64_t cacheConfig(std::uint64_t cache)
+    {
+        return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+
+    // -1 if the event isn't supported here
+    static int openEvent(PerfEvent event)
+    {
+        struct perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        switch (event)
+        {
+        case PERF_INSTRUCTIONS:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_CYCLES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_L1D_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cacheConfig(PERF_COUNT_HW_CACHE_L1D);
+            break;
+        case PERF_LLC_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cacheConfig(PERF_COUNT_HW_CACHE_LL);
+            break;
+        case PERF_DTLB_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cacheConfig(PERF_COUNT_HW_CACHE_DTLB);
+            break;
+        case PERF_BRANCH_MISSES:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        default:
+            return -1;
+        }
+
+        // this thread, any CPU
+        long fd = ::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        return (fd < 0) ? -1 : static_cast<int>(fd);
+    }
+};
+
+#endif
@@ -0,0 +1,405 @@
+// CHECKPOINT LOG
+// -Incremental on-disk checkpoints of the slot array, used by MySearchTree::checkpoint() / restore()
+// -A checkpoint directory holds a data file of page records and a MANIFEST. Each page record is a
+//      MappedPage image (see mappedtree.h). The manifest lists, for every live page, which record holds
+//      its latest image and that record's checksum, plus the key count
+// -Records are only ever appended. An incremental checkpoint appends the pages that changed since the
+//      last one and then commits a new manifest, so its I/O follows the number of changed pages rather
+//      than the size of the tree
+// -The manifest is the commit point: it is written to MANIFEST.tmp, synced, and renamed over MANIFEST
+//      after the data it points to has been synced. A crash at any moment leaves the previous
+//      checkpoint intact
+// -Superseded records are dead weight. Once they outnumber the live ones, the next checkpoint starts a
+//      new data file generation holding only live pages, and the old file is deleted after the commit
+// -Every record and the manifest itself carry a CRC-32, which restore() checks
+//
+// Functions
+//    1) begin / writePage / commit (used by MySearchTree::checkpoint)
+//    2) read (used by MySearchTree::restore)
+//    3) reset
+//    4) checksum32 / writeAllAt / syncDirectory (also used by MySearchTree::save)
+#ifndef __CHECKPOINT__
+#define __CHECKPOINT__
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+#include <memory>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mappedtree.h"
+
+static const std::uint32_t CHECKPOINT_VERSION = 1;
+static const char CHECKPOINT_MAGIC[8] = {'V', 'T', 'R', 'E', 'E', 'C', 'K', 'P'};
+
+struct Crc32Table
+{
+    Crc32Table()
+    {
+        for (std::uint32_t ii = 0; ii < 256; ++ii)
+        {
+            std::uint32_t crc = ii;
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+            }
+            m_entries[ii] = crc;
+        }
+    }
+
+    std::uint32_t m_entries[256];
+};
+
+// CRC-32 (IEEE 802.3 polynomial)
+inline std::uint32_t checksum32(const void* data, std::size_t length)
+{
+    static const Crc32Table table;
+
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    std::uint32_t crc = 0xFFFFFFFFu;
+    for (std::size_t ii = 0; ii < length; ++ii)
+    {
+        crc = table.m_entries[(crc ^ bytes[ii]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// writes all of data at offset, throwing std::runtime_error(error) if that fails
+inline void writeAllAt(int fd, const void* data, std::size_t length, std::uint64_t offset, const char* error)
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (length > 0)
+    {
+        ssize_t written = ::pwrite(fd, bytes, length, offset);
+        if (written <= 0)
+        {
+            throw std::runtime_error( error );
+        }
+        bytes += written;
+        length -= written;
+        offset += written;
+    }
+}
+
+// makes a rename into dir durable. Best effort, not every file system can sync a directory
+inline void syncDirectory(const std::string& dir)
+{
+    int fd = ::open(dir.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+struct ManifestHeader
+{
+    char m_magic[8];
+    std::uint32_t m_version;
+    std::uint32_t m_endianCheck;
+    std::uint32_t m_keySize;
+    std::uint32_t m_keyAlign;
+    std::uint32_t m_pageBits;
+    std::uint32_t m_reserved;
+    std::uint64_t m_generation;
+    std::uint64_t m_numKeys;
+    std::uint64_t m_numRecords; // records in the data file, live or not
+    std::uint64_t m_numEntries;
+};
+
+struct ManifestEntry
+{
+    std::uint64_t m_pageNum;
+    std::uint64_t m_record;
+    std::uint32_t m_checksum;
+    std::uint32_t m_reserved;
+};
+
+template<typename T>
+class CheckpointLog
+{
+public:
+    CheckpointLog(): m_generation(0), m_numRecords(0), m_dataFd(-1) {}
+
+    // a copy of a tree has to start its own checkpoints from scratch
+    CheckpointLog(const CheckpointLog&): m_generation(0), m_numRecords(0), m_dataFd(-1) {}
+
+    CheckpointLog& operator=(const CheckpointLog&)
+    {
+        reset();
+        return *this;
+    }
+
+    ~CheckpointLog()
+    {
+        closeData();
+    }
+
+    // forgets everything about the last checkpoint, so the next one writes every page
+    void reset()
+    {
+        closeData();
+        m_dir.clear();
+        m_entries.clear();
+        m_generation = 0;
+        m_numRecords = 0;
+    }
+
+    // Starts a checkpoint into dir. Returns true when every live page has to be written: the first
+    // checkpoint into dir, or a compaction into a new data file. Otherwise only changed pages are needed
+    bool begin(const std::string& dir)
+    {
+        bool full = (dir != m_dir) || (m_numRecords > 2 * m_entries.size() && m_numRecords > 0);
+        if (full)
+        {
+            if (dir != m_dir)
+            {
+                m_generation = readGeneration(dir);
+            }
+            m_dir = dir;
+            m_entries.clear();
+            m_numRecords = 0;
+            ++m_generation;
+            openData(O_CREAT | O_TRUNC);
+        }
+        else
+        {
+            openData(0);
+        }
+        return full;
+    }
+
+    void writePage(std::size_t pageNum, const MappedPage<T>& image)
+    {
+        ManifestEntry entry;
+        entry.m_pageNum = pageNum;
+        entry.m_record = m_numRecords;
+        entry.m_checksum = checksum32(&image, sizeof(image));
+        entry.m_reserved = 0;
+        writeAllAt(m_dataFd, &image, sizeof(image), m_numRecords * sizeof(image), "Failed to write checkpoint data");
+        ++m_numRecords;
+        m_entries[pageNum] = entry;
+    }
+
+    // Syncs the data and atomically replaces the manifest. livePages is every allocated page; entries
+    // for any other page are dropped
+    void commit(const std::vector<std::size_t>& livePages, std::uint64_t numKeys)
+    {
+        if (::fsync(m_dataFd) != 0)
+        {
+            throw std::runtime_error( "Failed to sync checkpoint data" );
+        }
+        closeData();
+
+        std::unordered_map<std::size_t, ManifestEntry> live;
+        std::vector<char> manifest(sizeof(ManifestHeader) + livePages.size() * sizeof(ManifestEntry));
+        ManifestHeader header = makeHeader(numKeys, livePages.size());
+        std::memcpy(manifest.data(), &header, sizeof(header));
+        char* next = manifest.data() + sizeof(header);
+        for (std::size_t pageNum : livePages)
+        {
+            auto it = m_entries.find(pageNum);
+            if (it == m_entries.end())
+            {
+                throw std::logic_error( "Live page is missing from the checkpoint" );
+            }
+            std::memcpy(next, &it->second, sizeof(ManifestEntry));
+            next += sizeof(ManifestEntry);
+            live.insert(*it);
+        }
+        std::uint32_t crc = checksum32(manifest.data(), manifest.size());
+        manifest.insert(manifest.end(), reinterpret_cast<const char*>(&crc),
+                        reinterpret_cast<const char*>(&crc) + sizeof(crc));
+
+        std::string tempPath = m_dir + "/MANIFEST.tmp";
+        int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            throw std::runtime_error( "Cannot create " + tempPath );
+        }
+        try
+        {
+            writeAllAt(fd, manifest.data(), manifest.size(), 0, "Failed to write checkpoint manifest");
+            if (::fsync(fd) != 0)
+            {
+                throw std::runtime_error( "Failed to sync checkpoint manifest" );
+            }
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+
+        if (std::rename(tempPath.c_str(), (m_dir + "/MANIFEST").c_str()) != 0)
+        {
+            throw std::runtime_error( "Failed to commit checkpoint manifest" );
+        }
+        syncDirectory(m_dir);
+        m_entries.swap(live);
+
+        // the previous generation is unreachable once the new manifest is in place
+        if (m_generation > 1)
+        {
+            ::unlink(dataPath(m_generation - 1).c_str());
+        }
+    }
+
+    // Reads the checkpoint in dir, calling load(pageNum, image) for every page, and returns the key
+    // count. Every checksum is verified first; throws std::runtime_error if anything doesn't match.
+    // Afterwards this log continues from that checkpoint
+    template<typename Loader>
+    std::uint64_t read(const std::string& dir, Loader load)
+    {
+        reset();
+        std::vector<char> manifest = readFile(dir + "/MANIFEST");
+        if (manifest.size() < sizeof(ManifestHeader) + sizeof(std::uint32_t))
+        {
+            throw std::runtime_error( "Checkpoint manifest is truncated" );
+        }
+        std::uint32_t crc;
+        std::memcpy(&crc, manifest.data() + manifest.size() - sizeof(crc), sizeof(crc));
+        if (checksum32(manifest.data(), manifest.size() - sizeof(crc)) != crc)
+        {
+            throw std::runtime_error( "Checkpoint manifest is corrupt" );
+        }
+
+        ManifestHeader header;
+        std::memcpy(&header, manifest.data(), sizeof(header));
+        ManifestHeader expected = makeHeader(header.m_numKeys, header.m_numEntries);
+        if (std::memcmp(header.m_magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+            header.m_version != expected.m_version || header.m_endianCheck != expected.m_endianCheck ||
+            header.m_keySize != expected.m_keySize || header.m_keyAlign != expected.m_keyAlign ||
+            header.m_pageBits != expected.m_pageBits ||
+            manifest.size() != sizeof(header) + header.m_numEntries * sizeof(ManifestEntry) + sizeof(crc))
+        {
+            throw std::runtime_error( "Checkpoint was written for a different key type or format" );
+        }
+
+        m_dir = dir;
+        m_generation = header.m_generation;
+        m_numRecords = header.m_numRecords;
+        openData(0);
+        std::unique_ptr<MappedPage<T> > image(new MappedPage<T>());
+        try
+        {
+            const char* next = manifest.data() + sizeof(header);
+            for (std::uint64_t ii = 0; ii < header.m_numEntries; ++ii, next += sizeof(ManifestEntry))
+            {
+                ManifestEntry entry;
+                std::memcpy(&entry, next, sizeof(entry));
+                if (::pread(m_dataFd, image.get(), sizeof(MappedPage<T>), entry.m_record * sizeof(MappedPage<T>)) !=
+                        static_cast<ssize_t>(sizeof(MappedPage<T>)) ||
+                    checksum32(image.get(), sizeof(MappedPage<T>)) != entry.m_checksum)
+                {
+                    throw std::runtime_error( "Checkpoint page is corrupt" );
+                }
+                load(entry.m_pageNum, *image);
+                m_entries[entry.m_pageNum] = entry;
+            }
+        }
+        catch (...)
+        {
+            reset();
+            throw;
+        }
+        closeData();
+        return header.m_numKeys;
+    }
+
+private:
+    std::string m_dir;
+    std::uint64_t m_generation;
+    std::uint64_t m_numRecords;
+    std::unordered_map<std::size_t, ManifestEntry> m_entries; // latest record of every page in the log
+    int m_dataFd;
+
+    std::string dataPath(std::uint64_t generation) const
+    {
+        return m_dir + "/pages." + std::to_string(generation) + ".dat";
+    }
+
+    ManifestHeader makeHeader(std::uint64_t numKeys, std::uint64_t numEntries) const
+    {
+        ManifestHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.m_magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+        header.m_version = CHECKPOINT_VERSION;
+        header.m_endianCheck = MAPPED_ENDIAN_CHECK;
+        header.m_keySize = sizeof(T);
+        header.m_keyAlign = alignof(T);
+        header.m_pageBits = MAPPED_PAGE_BITS;
+        header.m_generation = m_generation;
+        header.m_numKeys = numKeys;
+        header.m_numRecords = m_numRecords;
+        header.m_numEntries = numEntries;
+        return header;
+    }
+
+    // generation of whatever checkpoint is already in dir, so a new one never overwrites its data file
+    static std::uint64_t readGeneration(const std::string& dir)
+    {
+        ::mkdir(dir.c_str(), 0755);
+        int fd = ::open((dir + "/MANIFEST").c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return 0;
+        }
+        ManifestHeader header;
+        ssize_t got = ::pread(fd, &header, sizeof(header), 0);
+        ::close(fd);
+        return (got == static_cast<ssize_t>(sizeof(header))) ? header.m_generation : 0;
+    }
+
+    void openData(int flags)
+    {
+        closeData();
+        m_dataFd = ::open(dataPath(m_generation).c_str(), O_RDWR | flags, 0644);
+        if (m_dataFd < 0)
+        {
+            throw std::runtime_error( "Cannot open checkpoint data " + dataPath(m_generation) );
+        }
+    }
+
+    void closeData()
+    {
+        if (m_dataFd >= 0)
+        {
+            ::close(m_dataFd);
+            m_dataFd = -1;
+        }
+    }
+
+    static std::vector<char> readFile(const std::string& path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::runtime_error( "Cannot open " + path );
+        }
+        std::vector<char> contents;
+        char buffer[65536];
+        ssize_t got;
+        while ((got = ::read(fd, buffer, sizeof(buffer))) > 0)
+        {
+            contents.insert(contents.end(), buffer, buffer + got);
+        }
+        ::close(fd);
+        if (got < 0)
+        {
+            throw std::runtime_error( "Cannot read " + path );
+        }
+        return contents;
+    }
+};
+
+#endif
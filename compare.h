@@ -0,0 +1,163 @@
+// COMPARATOR POLICIES
+// -MySearchTree and FrozenSearchTree take their comparator as a template parameter, so every comparison
+//      is a direct call the compiler can inline instead of a trip through std::function
+// -A comparator is either three-way (returns <0, 0 or >0 like std::string::compare) or a strict weak
+//      ordering that returns bool (like std::less). CompareHolder turns either kind into the three-way
+//      result the descents branch on. Three-way comparators give that result in a single call per level
+// -Keys are always handed to the comparator by const ref
+// -Stateless comparators are stored as an empty base, so they add nothing to the size of the tree
+//
+// Functions
+//    1) ThreeWayCompare (the default, built from <)
+//    2) RuntimeCompare (wraps any callable in a std::function for comparators picked at runtime)
+//    3) CompareHolder::compare / less
+#ifndef __COMPARE__
+#define __COMPARE__
+
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+template<typename T>
+struct ThreeWayCompare
+{
+    int operator()(const T& lhs, const T& rhs) const
+    {
+        return static_cast<int>(rhs < lhs) - static_cast<int>(lhs < rhs);
+    }
+};
+
+// a string already knows how to compare itself in one pass
+template<>
+struct ThreeWayCompare<std::string>
+{
+    int operator()(const std::string& lhs, const std::string& rhs) const
+    {
+        return lhs.compare(rhs);
+    }
+};
+
+// Type erased three-way comparator for callers that only know the ordering at runtime. Anything
+// callable as int(const T&, const T&) converts to it; a default constructed one orders by <
+template<typename T>
+class RuntimeCompare
+{
+public:
+    RuntimeCompare(): m_function(ThreeWayCompare<T>()) {}
+
+    template<typename Function>
+    RuntimeCompare(Function function): m_function(function) {}
+
+    int operator()(const T& lhs, const T& rhs) const
+    {
+        return m_function(lhs, rhs);
+    }
+
+private:
+    std::function<int(const T&, const T&)> m_function;
+};
+
+// true when Compare orders keys the same way T's own < does, which the SIMD kernels rely on
+template<typename T, typename Compare>
+struct IsNaturalOrder : std::false_type {};
+
+template<typename T>
+struct IsNaturalOrder<T, ThreeWayCompare<T> > : std::true_type {};
+
+template<typename T>
+struct IsNaturalOrder<T, std::less<T> > : std::true_type {};
+
+template<typename T, typename Compare>
+struct ReturnsBool
+    : std::is_same<decltype(std::declval<const Compare&>()(std::declval<const T&>(), std::declval<const T&>())),
+                   bool> {};
+
+// turns a call to either kind of comparator into a three-way result or a less-than
+template<typename T, typename Compare>
+struct CompareOps
+{
+    static int compare(const Compare& comp, const T& lhs, const T& rhs)
+    {
+        return threeWay(comp, lhs, rhs, ReturnsBool<T, Compare>());
+    }
+
+    static bool less(const Compare& comp, const T& lhs, const T& rhs)
+    {
+        return isLess(comp, lhs, rhs, ReturnsBool<T, Compare>());
+    }
+
+private:
+    static int threeWay(const Compare& comp, const T& lhs, const T& rhs, std::true_type)
+    {
+        if (comp(lhs, rhs))
+        {
+            return -1;
+        }
+        return comp(rhs, lhs) ? 1 : 0;
+    }
+
+    static int threeWay(const Compare& comp, const T& lhs, const T& rhs, std::false_type)
+    {
+        return comp(lhs, rhs);
+    }
+
+    static bool isLess(const Compare& comp, const T& lhs, const T& rhs, std::true_type)
+    {
+        return comp(lhs, rhs);
+    }
+
+    static bool isLess(const Compare& comp, const T& lhs, const T& rhs, std::false_type)
+    {
+        return comp(lhs, rhs) < 0;
+    }
+};
+
+template<typename T, typename Compare,
+         bool Empty = std::is_empty<Compare>::value && !std::is_final<Compare>::value>
+class CompareHolder;
+
+// stateless comparators live in an empty base
+template<typename T, typename Compare>
+class CompareHolder<T, Compare, true> : private Compare
+{
+public:
+    explicit CompareHolder(const Compare& comparator): Compare(comparator) {}
+
+    const Compare& comparator() const { return *this; }
+
+    int compare(const T& lhs, const T& rhs) const
+    {
+        return CompareOps<T, Compare>::compare(comparator(), lhs, rhs);
+    }
+
+    bool less(const T& lhs, const T& rhs) const
+    {
+        return CompareOps<T, Compare>::less(comparator(), lhs, rhs);
+    }
+};
+
+// comparators with state are held as a member
+template<typename T, typename Compare>
+class CompareHolder<T, Compare, false>
+{
+public:
+    explicit CompareHolder(const Compare& comparator): m_comparator(comparator) {}
+
+    const Compare& comparator() const { return m_comparator; }
+
+    int compare(const T& lhs, const T& rhs) const
+    {
+        return CompareOps<T, Compare>::compare(m_comparator, lhs, rhs);
+    }
+
+    bool less(const T& lhs, const T& rhs) const
+    {
+        return CompareOps<T, Compare>::less(m_comparator, lhs, rhs);
+    }
+
+private:
+    Compare m_comparator;
+};
+
+#endif
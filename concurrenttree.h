@@ -0,0 +1,123 @@
+// CONCURRENT SEARCH TREE
+// -Optional wrapper that lets many threads share one MySearchTree
+// -The read path of MySearchTree (contains, rank, size, the batched lookups and freeze) is const, never
+//      allocates and never writes to the tree, so any number of readers can run side by side. Here they
+//      only take a shared lock, and writers take it exclusively
+// -Every call locks once, so the batched lookups are the cheapest way to push many keys through
+// -Nothing that hands out pointers into the tree (getRoot, find_batch) is exposed, since those would
+//      outlive the lock
+// -With a write-ahead log open (open_log), insert and remove only return once their change is on disk.
+//      They wait for that after letting go of the lock, so writers that arrive during one fsync are
+//      all covered by the next (group commit, see wal.h)
+//
+// Functions
+//    1) insert / remove / balance / setAutoBalance (exclusive)
+//    2) open_log / close_log (exclusive)
+//    3) contains / rank / size (shared)
+//    4) contains_batch / rank_batch (shared)
+//    5) freeze (shared)
+#ifndef __CONCURRENT_TREE__
+#define __CONCURRENT_TREE__
+
+#include <mutex>
+#include <shared_mutex>
+
+#include "tree.h"
+
+template<typename T, typename Compare = ThreeWayCompare<T> >
+class ConcurrentSearchTree
+{
+public:
+    ConcurrentSearchTree(const Compare& comparator = Compare()): m_tree(comparator)
+    {
+    }
+
+    bool insert(const T& value)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+        bool inserted = m_tree.insert(value);
+        std::uint64_t position = m_tree.log_position();
+        lock.unlock();
+
+        m_tree.sync_log(position);
+        return inserted;
+    }
+
+    bool remove(const T& value)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+        bool removed = m_tree.remove(value);
+        std::uint64_t position = m_tree.log_position();
+        lock.unlock();
+
+        m_tree.sync_log(position);
+        return removed;
+    }
+
+    // replays and attaches the log at path, see MySearchTree::open_log()
+    std::size_t open_log(const std::string& path)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+        return m_tree.open_log(path);
+    }
+
+    void close_log()
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+        m_tree.close_log();
+    }
+
+    int balance()
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+        return m_tree.balance();
+    }
+
+    void setAutoBalance(double alpha)
+    {
+        std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
+        m_tree.setAutoBalance(alpha);
+    }
+
+    bool contains(const T& value) const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        return m_tree.contains(value);
+    }
+
+    int rank(const T& value) const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        return m_tree.rank(value);
+    }
+
+    int size(const T& value) const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        return m_tree.size(value);
+    }
+
+    void contains_batch(const T* keys, std::size_t count, bool* out) const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        m_tree.contains_batch(keys, count, out);
+    }
+
+    void rank_batch(const T* keys, std::size_t count, int* out) const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        m_tree.rank_batch(keys, count, out);
+    }
+
+    FrozenSearchTree<T, Compare> freeze() const
+    {
+        std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+        return m_tree.freeze();
+    }
+
+private:
+    MySearchTree<T, Compare> m_tree;
+    mutable std::shared_timed_mutex m_mutex;
+};
+
+#endif
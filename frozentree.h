@@ -0,0 +1,193 @@
+// FROZEN SEARCH TREE
+// -Read-only snapshot of a MySearchTree, produced by MySearchTree::freeze()
+// -Keys are stored densely in Eytzinger (BFS) order: the root is at index 1, the children of x
+//      are at 2x and 2x + 1, exactly like the live tree but with no holes and no occupancy checks
+// -The array is padded out to a complete tree with copies of the largest key. The padding sits
+//      after every real key in sorted order, so every descent is exactly m_height levels long and
+//      the loop has no data dependent branches
+// -m_ranks holds the in-order position of every slot so rank() doesn't have to walk anything
+// -When the tree is ordered by the natural order of its keys (see IsNaturalOrder in compare.h) and the key type is a signed integer, float or
+//      double, lookups go through the vectorized kernels in simdsearch.h instead of the scalar loop
+//
+// Functions
+//    1) contains
+//    2) rank
+//    3) lower_bound
+//    4) size
+//    5) contains_batch / rank_batch
+#ifndef __FROZEN_TREE__
+#define __FROZEN_TREE__
+
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+#include "compare.h"
+#include "simdsearch.h"
+
+template<typename T, typename Compare = ThreeWayCompare<T> >
+class FrozenSearchTree : private CompareHolder<T, Compare>
+{
+public:
+    // sortedVals must be in ascending order according to comparator and contain no duplicates
+    FrozenSearchTree(const std::vector<T>& sortedVals, const Compare& comparator = Compare())
+        : CompareHolder<T, Compare>(comparator), m_numKeys(sortedVals.size()), m_height(0),
+          m_useSimd(IsNaturalOrder<T, Compare>::value && SimdSearch<T>::available)
+    {
+        while (((std::size_t(1) << m_height) - 1) < m_numKeys)
+        {
+            ++m_height;
+        }
+
+        std::size_t slots = std::size_t(1) << m_height;
+        m_keys.resize(slots);
+        m_ranks.resize(slots);
+        if (m_numKeys > 0)
+        {
+            std::size_t next = 0;
+            fill(sortedVals, ROOT_SLOT, next);
+        }
+    }
+
+    bool contains(const T& value) const
+    {
+        std::size_t k = lowerBoundSlot(value);
+        return k != 0 && compare(m_keys[k], value) == 0;
+    }
+
+    // number of keys smaller than value, or 0 if value isn't in the snapshot (same as MySearchTree::rank)
+    int rank(const T& value) const
+    {
+        std::size_t k = lowerBoundSlot(value);
+        if (k == 0 || compare(m_keys[k], value) != 0)
+        {
+            return 0;
+        }
+        return m_ranks[k];
+    }
+
+    // smallest key that is not less than value, or nullptr if every key is less than value
+    const T* lower_bound(const T& value) const
+    {
+        std::size_t k = lowerBoundSlot(value);
+        if (k == 0)
+        {
+            return nullptr;
+        }
+        return &m_keys[k];
+    }
+
+    int size() const
+    {
+        return m_numKeys;
+    }
+
+    // out[i] is contains(values[i]). With SIMD kernels available, several probes descend at once
+    void contains_batch(const T* values, std::size_t count, bool* out) const
+    {
+        std::size_t slots[BATCH_CHUNK];
+        for (std::size_t start = 0; start < count; start += BATCH_CHUNK)
+        {
+            std::size_t width = (count - start < BATCH_CHUNK) ? count - start : BATCH_CHUNK;
+            lowerBoundSlots(values + start, width, slots);
+            for (std::size_t ii = 0; ii < width; ++ii)
+            {
+                out[start + ii] = slots[ii] != 0 && compare(m_keys[slots[ii]], values[start + ii]) == 0;
+            }
+        }
+    }
+
+    // out[i] is rank(values[i])
+    void rank_batch(const T* values, std::size_t count, int* out) const
+    {
+        std::size_t slots[BATCH_CHUNK];
+        for (std::size_t start = 0; start < count; start += BATCH_CHUNK)
+        {
+            std::size_t width = (count - start < BATCH_CHUNK) ? count - start : BATCH_CHUNK;
+            lowerBoundSlots(values + start, width, slots);
+            for (std::size_t ii = 0; ii < width; ++ii)
+            {
+                bool found = slots[ii] != 0 && compare(m_keys[slots[ii]], values[start + ii]) == 0;
+                out[start + ii] = found ? m_ranks[slots[ii]] : 0;
+            }
+        }
+    }
+
+private:
+    static const std::size_t ROOT_SLOT = 1;
+    // a 64 byte line holds 16 ints, so prefetching slot 16k pulls in the great-great-grandchildren of k
+    static const std::size_t PREFETCH_DISTANCE = 16;
+    // batched lookups resolve this many slots at a time into a buffer on the stack
+    static const std::size_t BATCH_CHUNK = 64;
+
+    using CompareHolder<T, Compare>::compare;
+    using CompareHolder<T, Compare>::less;
+
+    std::vector<T> m_keys;
+    std::vector<int> m_ranks;
+    std::size_t m_numKeys;
+    int m_height;
+    bool m_useSimd;
+
+    // in-order walk of the complete tree, handing out sorted keys and then padding
+    void fill(const std::vector<T>& sortedVals, std::size_t slot, std::size_t& next)
+    {
+        if (slot >= m_keys.size())
+        {
+            return;
+        }
+
+        fill(sortedVals, slot * 2, next);
+        if (next < m_numKeys)
+        {
+            m_keys[slot] = sortedVals[next];
+            m_ranks[slot] = next;
+        }
+        else
+        {
+            m_keys[slot] = sortedVals.back();
+            m_ranks[slot] = m_numKeys;
+        }
+        ++next;
+        fill(sortedVals, slot * 2 + 1, next);
+    }
+
+    // Descends every level, going right whenever the current key is less than value. The final
+    // index encodes the path taken; the lower bound is the last node where we went left, which is
+    // found by shifting off the trailing right turns (1 bits) plus that one left turn. Returns 0
+    // when we never went left, ie. every key is less than value.
+    std::size_t lowerBoundSlot(const T& value) const
+    {
+        if (m_useSimd)
+        {
+            return SimdSearch<T>::lowerBoundSlot(m_keys.data(), m_height, value);
+        }
+
+        const T* keys = m_keys.data();
+        std::size_t k = ROOT_SLOT;
+        for (int level = 0; level < m_height; ++level)
+        {
+            // prefetch never faults, so it's fine for this address to run past the end of the array
+            __builtin_prefetch(reinterpret_cast<const void*>(
+                reinterpret_cast<std::uintptr_t>(keys) + k * PREFETCH_DISTANCE * sizeof(T)));
+            k = k * 2 + static_cast<std::size_t>(less(keys[k], value));
+        }
+        return k >> __builtin_ffsll(static_cast<long long>(~k));
+    }
+
+    void lowerBoundSlots(const T* values, std::size_t count, std::size_t* out) const
+    {
+        if (m_useSimd)
+        {
+            SimdSearch<T>::lowerBoundBatch(m_keys.data(), m_height, values, count, out);
+            return;
+        }
+
+        for (std::size_t ii = 0; ii < count; ++ii)
+        {
+            out[ii] = lowerBoundSlot(values[ii]);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,376 @@
+// MAPPED SEARCH TREE
+// -Read-only view of a tree image written by MySearchTree::save(), opened with
+//      MySearchTree::open_mapped(). The file is mmapped and queried in place: nothing is read up
+//      front, so opening is instant no matter how big the tree is, and the OS faults pages in as the
+//      descents touch them
+// -The image is the slot array itself, page by page, in the same layout the live tree uses: for each
+//      allocated page its keys, subtree sizes and occupancy bitmap. Pages that were never allocated
+//      aren't stored, so a sparse tree doesn't turn into a huge file
+// -Only trivially copyable keys can be saved, since they are written and read back as raw bytes. The
+//      header records the format version, key size and alignment, page size and byte order, and
+//      open_mapped() refuses images that don't match
+//
+// File layout (all offsets from the start of the file)
+//    1) MappedHeader
+//    2) directory: the page number of every stored page, ascending
+//    3) dense index: for page numbers below numDense, the page's position in the directory, or
+//       NO_PAGE. Anything above that is found by binary search in the directory
+//    4) the pages themselves (MappedPage), starting on a MAPPED_ALIGNMENT boundary
+//
+// Functions
+//    1) contains / rank / select / count_between / lower_bound
+//    2) size
+#ifndef __MAPPED_TREE__
+#define __MAPPED_TREE__
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "compare.h"
+
+static const std::uint32_t MAPPED_VERSION = 1;
+static const std::uint32_t MAPPED_ENDIAN_CHECK = 0x01020304;
+static const std::uint32_t MAPPED_PAGE_BITS = 9;
+static const std::size_t MAPPED_PAGE_SIZE = std::size_t(1) << MAPPED_PAGE_BITS;
+static const std::uint32_t MAPPED_NO_PAGE = UINT32_MAX;
+// the first page starts on an OS page boundary (m_pagesOffset is a multiple of this). Every page after
+// it starts a whole MappedPage later, so each key in the mapping is still aligned to alignof(T)
+static const std::size_t MAPPED_ALIGNMENT = 4096;
+static const char MAPPED_MAGIC[8] = {'V', 'T', 'R', 'E', 'E', 'I', 'M', 'G'};
+
+struct MappedHeader
+{
+    char m_magic[8];
+    std::uint32_t m_version;
+    std::uint32_t m_endianCheck;
+    std::uint32_t m_keySize;
+    std::uint32_t m_keyAlign;
+    std::uint32_t m_pageBits;
+    std::uint32_t m_reserved;
+    std::uint64_t m_numKeys;
+    std::uint64_t m_numPages;
+    std::uint64_t m_numDense;
+    std::uint64_t m_directoryOffset;
+    std::uint64_t m_denseOffset;
+    std::uint64_t m_pagesOffset;
+};
+
+template<typename T>
+struct MappedPage
+{
+    T m_keys[MAPPED_PAGE_SIZE];
+    std::int32_t m_sizes[MAPPED_PAGE_SIZE];
+    std::uint64_t m_occupied[MAPPED_PAGE_SIZE / 64];
+};
+
+template<typename T, typename Compare = ThreeWayCompare<T> >
+class MappedSearchTree : private CompareHolder<T, Compare>
+{
+public:
+    // maps the image at path. Throws std::runtime_error if it can't be opened or wasn't written for T
+    explicit MappedSearchTree(const std::string& path, const Compare& comparator = Compare())
+        : CompareHolder<T, Compare>(comparator), m_base(nullptr), m_length(0)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw std::runtime_error( "Cannot open tree image " + path );
+        }
+
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || static_cast<std::size_t>(info.st_size) < sizeof(MappedHeader))
+        {
+            ::close(fd);
+            throw std::runtime_error( "Tree image is truncated: " + path );
+        }
+
+        m_length = static_cast<std::size_t>(info.st_size);
+        void* base = ::mmap(nullptr, m_length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED)
+        {
+            throw std::runtime_error( "Cannot map tree image " + path );
+        }
+        m_base = static_cast<const char*>(base);
+
+        try
+        {
+            validate();
+        }
+        catch (...)
+        {
+            ::munmap(const_cast<char*>(m_base), m_length);
+            throw;
+        }
+    }
+
+    ~MappedSearchTree()
+    {
+        if (m_base != nullptr)
+        {
+            ::munmap(const_cast<char*>(m_base), m_length);
+        }
+    }
+
+    MappedSearchTree(const MappedSearchTree&) = delete;
+    MappedSearchTree& operator=(const MappedSearchTree&) = delete;
+
+    MappedSearchTree(MappedSearchTree&& other)
+        : CompareHolder<T, Compare>(other), m_base(other.m_base), m_length(other.m_length),
+          m_header(other.m_header), m_directory(other.m_directory), m_dense(other.m_dense),
+          m_pages(other.m_pages)
+    {
+        other.m_base = nullptr;
+    }
+
+    bool contains(const T& value) const
+    {
+        std::size_t current = ROOT_SLOT;
+        while (const T* key = keyAt(current))
+        {
+            int result = compare(value, *key);
+            if (result == 0)
+            {
+                return true;
+            }
+            current = current * 2 + (result > 0 ? 1 : 0);
+        }
+        return false;
+    }
+
+    // number of keys smaller than value, or 0 if value isn't in the image (same as MySearchTree::rank)
+    int rank(const T& value) const
+    {
+        std::size_t current = ROOT_SLOT;
+        int rankSum = 0;
+        while (const T* key = keyAt(current))
+        {
+            int result = compare(value, *key);
+            if (result == 0)
+            {
+                return rankSum + subtreeSize(current * 2);
+            }
+            else if (result > 0)
+            {
+                rankSum += subtreeSize(current * 2) + 1;
+                current = current * 2 + 1;
+            }
+            else
+            {
+                current = current * 2;
+            }
+        }
+        return 0;
+    }
+
+    // the key with exactly k smaller keys
+    const T& select(int k) const
+    {
+        if (k < 0 || k >= size())
+        {
+            throw std::out_of_range( "select() index is outside the tree" );
+        }
+
+        std::size_t current = ROOT_SLOT;
+        while (true)
+        {
+            // the sizes say a key is here, only a corrupt image can disagree
+            const T* key = keyAt(current);
+            if (key == nullptr)
+            {
+                throw std::runtime_error( "Tree image has corrupt subtree sizes" );
+            }
+            int leftSize = subtreeSize(current * 2);
+            if (k == leftSize)
+            {
+                return *key;
+            }
+            else if (k > leftSize)
+            {
+                k -= leftSize + 1;
+                current = current * 2 + 1;
+            }
+            else
+            {
+                current = current * 2;
+            }
+        }
+    }
+
+    // number of keys in [lo, hi]
+    int count_between(const T& lo, const T& hi) const
+    {
+        if (compare(lo, hi) > 0)
+        {
+            return 0;
+        }
+        return countBelow(hi, true) - countBelow(lo, false);
+    }
+
+    // smallest key that is not less than value, or nullptr. Points into the mapping
+    const T* lower_bound(const T& value) const
+    {
+        std::size_t current = ROOT_SLOT;
+        const T* bound = nullptr;
+        while (const T* key = keyAt(current))
+        {
+            int result = compare(value, *key);
+            if (result == 0)
+            {
+                return key;
+            }
+            if (result < 0)
+            {
+                bound = key;
+                current = current * 2;
+            }
+            else
+            {
+                current = current * 2 + 1;
+            }
+        }
+        return bound;
+    }
+
+    int size() const
+    {
+        return static_cast<int>(m_header->m_numKeys);
+    }
+
+private:
+    static const std::size_t ROOT_SLOT = 1;
+    static const std::size_t MAX_SLOT_INDEX = SIZE_MAX / 2; // same as MySearchTree's
+
+    const char* m_base;
+    std::size_t m_length;
+    const MappedHeader* m_header;
+    const std::uint64_t* m_directory;
+    const std::uint32_t* m_dense;
+    const MappedPage<T>* m_pages;
+
+    using CompareHolder<T, Compare>::compare;
+
+    void validate()
+    {
+        m_header = reinterpret_cast<const MappedHeader*>(m_base);
+        if (std::memcmp(m_header->m_magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC)) != 0)
+        {
+            throw std::runtime_error( "Not a tree image" );
+        }
+        if (m_header->m_version != MAPPED_VERSION || m_header->m_endianCheck != MAPPED_ENDIAN_CHECK)
+        {
+            throw std::runtime_error( "Tree image was written by an incompatible version or machine" );
+        }
+        if (m_header->m_keySize != sizeof(T) || m_header->m_keyAlign != alignof(T) ||
+            m_header->m_pageBits != MAPPED_PAGE_BITS)
+        {
+            throw std::runtime_error( "Tree image was written for a different key type" );
+        }
+
+        // the counts come from the file, so each one is checked against the room left for its section
+        // by dividing, a product could wrap around and pass
+        const MappedHeader& header = *m_header;
+        if (header.m_directoryOffset < sizeof(MappedHeader) || header.m_directoryOffset > header.m_denseOffset ||
+            header.m_denseOffset > header.m_pagesOffset || header.m_pagesOffset > m_length ||
+            header.m_directoryOffset % alignof(std::uint64_t) != 0 ||
+            header.m_denseOffset % alignof(std::uint32_t) != 0 || header.m_pagesOffset % MAPPED_ALIGNMENT != 0)
+        {
+            throw std::runtime_error( "Tree image has a corrupt header" );
+        }
+        if (header.m_numPages > (header.m_denseOffset - header.m_directoryOffset) / sizeof(std::uint64_t) ||
+            header.m_numDense > (header.m_pagesOffset - header.m_denseOffset) / sizeof(std::uint32_t) ||
+            header.m_numPages > (m_length - header.m_pagesOffset) / sizeof(MappedPage<T>))
+        {
+            throw std::runtime_error( "Tree image is truncated" );
+        }
+
+        m_directory = reinterpret_cast<const std::uint64_t*>(m_base + m_header->m_directoryOffset);
+        m_dense = reinterpret_cast<const std::uint32_t*>(m_base + m_header->m_denseOffset);
+        m_pages = reinterpret_cast<const MappedPage<T>*>(m_base + m_header->m_pagesOffset);
+
+        // lookups index m_pages straight from the dense index, so every entry has to be in range
+        for (std::uint64_t pageNum = 0; pageNum < m_header->m_numDense; ++pageNum)
+        {
+            if (m_dense[pageNum] != MAPPED_NO_PAGE && m_dense[pageNum] >= m_header->m_numPages)
+            {
+                throw std::runtime_error( "Tree image has a corrupt page index" );
+            }
+        }
+    }
+
+    const MappedPage<T>* findPage(std::size_t index) const
+    {
+        std::uint64_t pageNum = index >> MAPPED_PAGE_BITS;
+        if (pageNum < m_header->m_numDense)
+        {
+            std::uint32_t position = m_dense[pageNum];
+            return (position == MAPPED_NO_PAGE) ? nullptr : &m_pages[position];
+        }
+
+        const std::uint64_t* end = m_directory + m_header->m_numPages;
+        const std::uint64_t* found = std::lower_bound(m_directory, end, pageNum);
+        if (found == end || *found != pageNum)
+        {
+            return nullptr;
+        }
+        return &m_pages[found - m_directory];
+    }
+
+    // The key in the slot, or nullptr if the slot is open. MySearchTree never fills a slot past
+    // MAX_SLOT_INDEX, so a filled one out there is corrupt. Refusing it is also what stops every descent
+    // within 64 levels, before a child index could wrap around
+    const T* keyAt(std::size_t index) const
+    {
+        const MappedPage<T>* page = findPage(index);
+        std::size_t offset = index & (MAPPED_PAGE_SIZE - 1);
+        if (page == nullptr || ((page->m_occupied[offset / 64] >> (offset % 64)) & 1) == 0)
+        {
+            return nullptr;
+        }
+        if (index > MAX_SLOT_INDEX)
+        {
+            throw std::runtime_error( "Tree image is deeper than any tree can be" );
+        }
+        return &page->m_keys[offset];
+    }
+
+    int subtreeSize(std::size_t index) const
+    {
+        const MappedPage<T>* page = findPage(index);
+        return (page == nullptr) ? 0 : page->m_sizes[index & (MAPPED_PAGE_SIZE - 1)];
+    }
+
+    int countBelow(const T& value, bool inclusive) const
+    {
+        std::size_t current = ROOT_SLOT;
+        int count = 0;
+        while (const T* key = keyAt(current))
+        {
+            int result = compare(value, *key);
+            if (result == 0)
+            {
+                return count + subtreeSize(current * 2) + (inclusive ? 1 : 0);
+            }
+            else if (result > 0)
+            {
+                count += subtreeSize(current * 2) + 1;
+                current = current * 2 + 1;
+            }
+            else
+            {
+                current = current * 2;
+            }
+        }
+        return count;
+    }
+};
+
+#endif
@@ -0,0 +1,102 @@
+// KEY MULTIPLICITY POLICIES
+// -MySearchTree takes what it does with repeated keys as its fifth template parameter
+// -UniqueKeys (the default) keeps set semantics: insert() refuses a key that is already there. Its
+//      count is the constant 1, so the empty base it adds to every node takes no space and every
+//      multiplicity term in the descents folds away at compile time
+// -CountedKeys turns the tree into a multiset. Each node holds its key once, with a count of how many
+//      times it is in the tree right next to it, so reading or bumping the count touches the cache line
+//      the descent already loaded. insert() of a present key increments the count and remove()
+//      decrements it; the slot is only emptied once the count reaches 0
+// -Under CountedKeys the subtree sizes add up the counts, so rank, size, select and count_between all
+//      count repeats. The slot structure (and so balancing) is still one slot per distinct key
+// -The write-ahead log stores a LogKey per record. Under CountedKeys that is the key together with its
+//      count after the change, so replaying a record sets the count instead of adding to it and stays
+//      harmless to repeat, the same as set semantics make it for plain records
+//
+// Functions
+//    1) UniqueKeys / CountedKeys (the policies)
+//    2) Count (base of every node, count / setCount)
+//    3) LogKey / makeLogKey / logKeyOf / logCountOf (what the write-ahead log records)
+#ifndef __MULTIPLICITY__
+#define __MULTIPLICITY__
+
+#include <cstdint>
+
+struct UniqueKeys
+{
+    static const bool MULTISET = false;
+
+    class Count
+    {
+    public:
+        int count() const { return 1; }
+        void setCount(int) {}
+    };
+
+    template<typename T>
+    using LogKey = T;
+
+    template<typename T>
+    static const T& makeLogKey(const T& key, int)
+    {
+        return key;
+    }
+
+    template<typename T>
+    static const T& logKeyOf(const T& record)
+    {
+        return record;
+    }
+
+    template<typename T>
+    static int logCountOf(const T&)
+    {
+        return 1;
+    }
+};
+
+struct CountedKeys
+{
+    static const bool MULTISET = true;
+
+    class Count
+    {
+    public:
+        Count(): m_count(1) {}
+        int count() const { return m_count; }
+        void setCount(int count) { m_count = count; }
+
+    private:
+        int m_count;
+    };
+
+    template<typename T>
+    struct LogKey
+    {
+        T m_key;
+        std::int32_t m_count; // after the change, 0 once the key is gone
+    };
+
+    template<typename T>
+    static LogKey<T> makeLogKey(const T& key, int count)
+    {
+        LogKey<T> record;
+        record.m_key = key;
+        record.m_count = count;
+        return record;
+    }
+
+    template<typename T>
+    static const T& logKeyOf(const LogKey<T>& record)
+    {
+        return record.m_key;
+    }
+
+    template<typename T>
+    static int logCountOf(const LogKey<T>& record)
+    {
+        return record.m_count;
+    }
+};
+
+#endif
@@ -0,0 +1,616 @@
+// PAGED SLOTS
+// -Backing store for the implicit slot array of MySearchTree
+// -The index space is cut into fixed size pages of PAGE_SIZE slots. A page is only allocated the
+//      first time one of its slots is filled, and it is released again once its last slot is emptied,
+//      so the empty parts of deep levels cost nothing
+// -Each page holds the slot values, the subtree sizes and an occupancy bitmap for its index range
+// -Pages for the first DENSE_PAGES ranges live in a directly indexed table. Anything past that is kept
+//      in a hash map keyed by page number, because at those depths the index space is far too big to
+//      address directly and almost all of it is empty
+// -Slots on pages that were never allocated read as open with a subtree size of 0
+// -Every page has a dirty flag that is set whenever anything on it may have changed, so checkpoints
+//      only have to write the pages touched since the last one
+// -Pages come from the Allocator (rebound to the page type). With SlabAllocator, pages freed by removes
+//      and rebuilds are reused straight from its free list, and clear() hands whole slabs back at once
+//
+// Functions
+//    1) get / occupied / subtreeSize (never allocate)
+//    2) occupy / vacate
+//    3) value / addSubtreeSize (the slot's page must exist)
+//    4) clear / reserve
+//    5) prefetch
+//    6) allocatePages / occupyConcurrent / releaseEmptyPages (filling slots from several threads)
+//    7) releaseStorage
+//    8) forEachPage (read access to whole pages, for saving them)
+//    9) takeDirtyPages / markClean / loadPage (page level change tracking for checkpoints)
+//   10) numAllocations / pageBytes (allocation counts for MySearchTree::stats)
+//   11) shrinkToFit / memoryUsage / numOccupied
+#ifndef __PAGED_SLOTS__
+#define __PAGED_SLOTS__
+
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+
+#include "slaballocator.h"
+
+// what the slot storage takes up right now, see PagedSlots::memoryUsage()
+struct MemoryUsage
+{
+    MemoryUsage(): m_slots(0), m_occupied(0), m_pages(0), m_bytes(0) {}
+
+    std::size_t m_slots; // on allocated pages, open or not
+    std::size_t m_occupied;
+    std::size_t m_pages;
+    std::size_t m_bytes; // the pages plus the tables that find them
+};
+
+template<typename V, typename Allocator = std::allocator<V> >
+class PagedSlots
+{
+public:
+    static const std::size_t PAGE_BITS = 9;
+    static const std::size_t PAGE_SIZE = std::size_t(1) << PAGE_BITS;
+    static const std::size_t DENSE_PAGES = 4096;
+
+    explicit PagedSlots(const Allocator& allocator = Allocator())
+        : m_allocator(allocator), m_numAllocations(0), m_numPages(0), m_numOccupied(0)
+    {
+    }
+
+    ~PagedSlots()
+    {
+        clear();
+    }
+
+    PagedSlots(const PagedSlots& other)
+        : m_allocator(PageTraits::select_on_container_copy_construction(other.m_allocator)), m_numAllocations(0),
+          m_numPages(0), m_numOccupied(0)
+    {
+        try
+        {
+            copyFrom(other);
+        }
+        catch (...)
+        {
+            clear();
+            throw;
+        }
+    }
+
+    PagedSlots& operator=(const PagedSlots& other)
+    {
+        if (this != &other)
+        {
+            clear();
+            copyFrom(other);
+        }
+        return *this;
+    }
+
+    // the pages are handed over as they are, so the allocator that made them comes along too
+    PagedSlots(PagedSlots&& other)
+        : m_densePages(std::move(other.m_densePages)), m_sparsePages(std::move(other.m_sparsePages)),
+          m_allocator(other.m_allocator), m_numAllocations(other.m_numAllocations), m_numPages(other.m_numPages),
+          m_numOccupied(other.m_numOccupied)
+    {
+        other.m_densePages.clear();
+        other.m_sparsePages.clear();
+        other.m_numPages = 0;
+        other.m_numOccupied = 0;
+    }
+
+    PagedSlots& operator=(PagedSlots&& other)
+    {
+        if (this != &other)
+        {
+            clear();
+            m_densePages.swap(other.m_densePages);
+            m_sparsePages.swap(other.m_sparsePages);
+            m_allocator = other.m_allocator;
+            m_numAllocations = other.m_numAllocations;
+            m_numPages = other.m_numPages;
+            m_numOccupied = other.m_numOccupied;
+            other.m_numPages = 0;
+            other.m_numOccupied = 0;
+        }
+        return *this;
+    }
+
+    // value stored in the slot, or nullptr if the slot is open
+    const V* get(std::size_t index) const
+    {
+        const Page* page = findPage(index);
+        std::size_t offset = index & OFFSET_MASK;
+        if (page == nullptr || !page->isSet(offset))
+        {
+            return nullptr;
+        }
+        return &page->m_values[offset];
+    }
+
+    bool occupied(std::size_t index) const
+    {
+        const Page* page = findPage(index);
+        return page != nullptr && page->isSet(index & OFFSET_MASK);
+    }
+
+    int subtreeSize(std::size_t index) const
+    {
+        const Page* page = findPage(index);
+        if (page == nullptr)
+        {
+            return 0;
+        }
+        return page->m_sizes[index & OFFSET_MASK];
+    }
+
+    // hints the cache to start loading the slot's value and occupancy word. Open slots and pages that
+    // were never allocated are fine, there is just nothing to fetch
+    void prefetch(std::size_t index) const
+    {
+        const Page* page = findPage(index);
+        if (page != nullptr)
+        {
+            std::size_t offset = index & OFFSET_MASK;
+            __builtin_prefetch(&page->m_values[offset]);
+            __builtin_prefetch(&page->m_occupied[offset / WORD_BITS]);
+        }
+    }
+
+    // the slot must be occupied. The page counts as changed, since the caller may write through it
+    V& value(std::size_t index)
+    {
+        Page* page = findPage(index);
+        page->markDirty();
+        return page->m_values[index & OFFSET_MASK];
+    }
+
+    const V& value(std::size_t index) const
+    {
+        return findPage(index)->m_values[index & OFFSET_MASK];
+    }
+
+    // the slot must be occupied (or about to be, ie. occupy() was already called on it)
+    void addSubtreeSize(std::size_t index, int delta)
+    {
+        Page* page = findPage(index);
+        page->markDirty();
+        page->m_sizes[index & OFFSET_MASK] += delta;
+    }
+
+    // marks the slot as occupied, allocating its page if needed, and returns the value to fill in
+    V& occupy(std::size_t index)
+    {
+        Page& page = getOrCreatePage(index);
+        page.m_dirty = true;
+        std::size_t offset = index & OFFSET_MASK;
+        if (!page.isSet(offset))
+        {
+            page.set(offset);
+            ++page.m_numOccupied;
+            ++m_numOccupied;
+        }
+        return page.m_values[offset];
+    }
+
+    // marks the slot as open and resets its value. The subtree size must already be back to 0.
+    // The page is released once nothing on it is occupied
+    void vacate(std::size_t index)
+    {
+        std::size_t pageNum = index >> PAGE_BITS;
+        Page* page = findPage(index);
+        std::size_t offset = index & OFFSET_MASK;
+        if (page == nullptr || !page->isSet(offset))
+        {
+            return;
+        }
+
+        page->m_dirty = true;
+        page->unset(offset);
+        --page->m_numOccupied;
+        --m_numOccupied;
+        if (page->m_numOccupied == 0)
+        {
+            releasePage(pageNum);
+        }
+        else
+        {
+            page->m_values[offset] = V();
+        }
+    }
+
+    // Allocates every page up to the one holding lastIndex, so that occupyConcurrent() can fill any
+    // slot in that range. Pages that are still empty afterwards should be dropped with releaseEmptyPages()
+    void allocatePages(std::size_t lastIndex)
+    {
+        reserve(lastIndex);
+        for (std::size_t pageNum = 0; pageNum <= (lastIndex >> PAGE_BITS); ++pageNum)
+        {
+            getOrCreatePage(pageNum << PAGE_BITS);
+        }
+    }
+
+    // Same as occupy() but safe to call from several threads at once, as long as no two threads fill
+    // the same slot. The page must already exist (see allocatePages); neighbouring slots share
+    // occupancy words, so the bit and the page count are updated atomically. The total behind
+    // numOccupied() is left alone here and recounted by releaseEmptyPages()
+    V& occupyConcurrent(std::size_t index)
+    {
+        Page* page = findPage(index);
+        std::size_t offset = index & OFFSET_MASK;
+        std::uint64_t bit = std::uint64_t(1) << (offset % WORD_BITS);
+        std::uint64_t before = __atomic_fetch_or(&page->m_occupied[offset / WORD_BITS], bit, __ATOMIC_RELAXED);
+        if ((before & bit) == 0)
+        {
+            __atomic_fetch_add(&page->m_numOccupied, 1, __ATOMIC_RELAXED);
+        }
+        page->markDirty();
+        return page->m_values[offset];
+    }
+
+    // drops the pages that allocatePages() created but nothing was put on
+    void releaseEmptyPages()
+    {
+        m_numOccupied = 0;
+        for (std::size_t pageNum = 0; pageNum < m_densePages.size(); ++pageNum)
+        {
+            if (m_densePages[pageNum] != nullptr && m_densePages[pageNum]->m_numOccupied == 0)
+            {
+                destroyPage(m_densePages[pageNum]);
+                m_densePages[pageNum] = nullptr;
+            }
+            else if (m_densePages[pageNum] != nullptr)
+            {
+                m_numOccupied += m_densePages[pageNum]->m_numOccupied;
+            }
+        }
+        while (!m_densePages.empty() && m_densePages.back() == nullptr)
+        {
+            m_densePages.pop_back();
+        }
+
+        for (auto it = m_sparsePages.begin(); it != m_sparsePages.end(); )
+        {
+            if (it->second->m_numOccupied == 0)
+            {
+                destroyPage(it->second);
+                it = m_sparsePages.erase(it);
+            }
+            else
+            {
+                m_numOccupied += it->second->m_numOccupied;
+                ++it;
+            }
+        }
+    }
+
+    void clear()
+    {
+        for (Page* page : m_densePages)
+        {
+            if (page != nullptr)
+            {
+                destroyPage(page);
+            }
+        }
+        for (const auto& entry : m_sparsePages)
+        {
+            destroyPage(entry.second);
+        }
+        m_densePages.clear();
+        m_sparsePages.clear();
+        m_numOccupied = 0;
+    }
+
+    // clears, and then lets the allocator give back any memory it kept around for reuse
+    void releaseStorage()
+    {
+        clear();
+        releaseSlabs(m_allocator);
+    }
+
+    // sizes the page table up front for a fill that will reach lastIndex, pages are still allocated
+    // as they are filled
+    void reserve(std::size_t lastIndex)
+    {
+        std::size_t lastPage = std::min(lastIndex >> PAGE_BITS, DENSE_PAGES - 1);
+        if (lastPage >= m_densePages.size())
+        {
+            m_densePages.resize(lastPage + 1);
+        }
+    }
+
+    // Calls visit(pageNum, values, sizes, occupied) for every allocated page in ascending page order.
+    // occupied is the page's bitmap, PAGE_SIZE / 64 words with bit i set when slot i of the page is filled
+    template<typename Visitor>
+    void forEachPage(Visitor visit) const
+    {
+        for (std::size_t pageNum = 0; pageNum < m_densePages.size(); ++pageNum)
+        {
+            const Page* page = m_densePages[pageNum];
+            if (page != nullptr)
+            {
+                visit(pageNum, page->m_values, page->m_sizes, page->m_occupied);
+            }
+        }
+
+        std::vector<std::size_t> sparseNums;
+        sparseNums.reserve(m_sparsePages.size());
+        for (const auto& entry : m_sparsePages)
+        {
+            sparseNums.push_back(entry.first);
+        }
+        std::sort(sparseNums.begin(), sparseNums.end());
+        for (std::size_t pageNum : sparseNums)
+        {
+            const Page* page = m_sparsePages.find(pageNum)->second;
+            visit(pageNum, page->m_values, page->m_sizes, page->m_occupied);
+        }
+    }
+
+    // calls visit(pageNum, values, sizes, occupied) like forEachPage(), but only for pages changed
+    // since the last takeDirtyPages() / markClean(), and marks them clean
+    template<typename Visitor>
+    void takeDirtyPages(Visitor visit)
+    {
+        forEachPage([&](std::size_t pageNum, const V* values, const int* sizes, const std::uint64_t* occupied)
+        {
+            Page* page = findPage(pageNum << PAGE_BITS);
+            if (page->m_dirty)
+            {
+                visit(pageNum, values, sizes, occupied);
+                page->m_dirty = false;
+            }
+        });
+    }
+
+    void markClean()
+    {
+        forEachPage([&](std::size_t pageNum, const V*, const int*, const std::uint64_t*)
+        {
+            findPage(pageNum << PAGE_BITS)->m_dirty = false;
+        });
+    }
+
+    // Creates page pageNum (which must not exist yet) with the given sizes and occupancy bitmap, and
+    // returns its values for the caller to fill in. The page starts out clean
+    template<typename Size>
+    V* loadPage(std::size_t pageNum, const Size* sizes, const std::uint64_t* occupied)
+    {
+        Page& page = getOrCreatePage(pageNum << PAGE_BITS);
+        std::copy(sizes, sizes + PAGE_SIZE, page.m_sizes);
+        std::copy(occupied, occupied + PAGE_SIZE / WORD_BITS, page.m_occupied);
+        page.m_numOccupied = 0;
+        for (std::size_t word = 0; word < PAGE_SIZE / WORD_BITS; ++word)
+        {
+            page.m_numOccupied += __builtin_popcountll(occupied[word]);
+        }
+        m_numOccupied += page.m_numOccupied;
+        page.m_dirty = false;
+        return page.m_values;
+    }
+
+    // pages allocated over this storage's lifetime, and the bytes each one takes
+    std::size_t numAllocations() const
+    {
+        return m_numAllocations;
+    }
+
+    static std::size_t pageBytes()
+    {
+        return sizeof(Page);
+    }
+
+    // pages allocated right now
+    std::size_t numPages() const
+    {
+        return m_numPages;
+    }
+
+    // Gives back the spare capacity of the page tables. The pages themselves are already exactly the
+    // ones in use, since empty pages are released as soon as they empty out
+    void shrinkToFit()
+    {
+        while (!m_densePages.empty() && m_densePages.back() == nullptr)
+        {
+            m_densePages.pop_back();
+        }
+        m_densePages.shrink_to_fit();
+        m_sparsePages.rehash(0);
+    }
+
+    // occupied slots over all pages
+    std::size_t numOccupied() const
+    {
+        return m_numOccupied;
+    }
+
+    MemoryUsage memoryUsage() const
+    {
+        MemoryUsage usage;
+        usage.m_pages = m_numPages;
+        usage.m_slots = m_numPages * PAGE_SIZE;
+        usage.m_occupied = m_numOccupied;
+        // each hash map entry is a node holding the pair and a next pointer, plus its bucket
+        usage.m_bytes = m_numPages * sizeof(Page) + m_densePages.capacity() * sizeof(Page*) +
+                        m_sparsePages.bucket_count() * sizeof(void*) +
+                        m_sparsePages.size() * (sizeof(std::pair<const std::size_t, Page*>) + sizeof(void*));
+        return usage;
+    }
+
+private:
+    static const std::size_t OFFSET_MASK = PAGE_SIZE - 1;
+    static const std::size_t WORD_BITS = 64;
+
+    struct Page
+    {
+        Page(): m_numOccupied(0), m_dirty(true)
+        {
+            std::fill(m_sizes, m_sizes + PAGE_SIZE, 0);
+            std::fill(m_occupied, m_occupied + PAGE_SIZE / WORD_BITS, 0);
+        }
+
+        bool isSet(std::size_t offset) const
+        {
+            return (m_occupied[offset / WORD_BITS] >> (offset % WORD_BITS)) & 1;
+        }
+
+        void set(std::size_t offset)
+        {
+            m_occupied[offset / WORD_BITS] |= std::uint64_t(1) << (offset % WORD_BITS);
+        }
+
+        void unset(std::size_t offset)
+        {
+            m_occupied[offset / WORD_BITS] &= ~(std::uint64_t(1) << (offset % WORD_BITS));
+        }
+
+        // atomic because a parallel balance writes distinct slots of one page from several threads.
+        // Relaxed is enough, nothing is ordered by it, and it costs the same as a plain store
+        void markDirty()
+        {
+            __atomic_store_n(&m_dirty, true, __ATOMIC_RELAXED);
+        }
+
+        V m_values[PAGE_SIZE];
+        int m_sizes[PAGE_SIZE];
+        std::uint64_t m_occupied[PAGE_SIZE / WORD_BITS];
+        std::size_t m_numOccupied;
+        bool m_dirty; // changed since the last checkpoint
+    };
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<Page> PageAllocator;
+    typedef std::allocator_traits<PageAllocator> PageTraits;
+
+    // every page in these is owned and freed through m_allocator
+    std::vector<Page*> m_densePages;
+    std::unordered_map<std::size_t, Page*> m_sparsePages;
+    PageAllocator m_allocator;
+    std::size_t m_numAllocations; // pages ever allocated, for MySearchTree::stats()
+    std::size_t m_numPages; // pages allocated right now
+    std::size_t m_numOccupied; // slots filled right now, over all pages
+
+    template<typename... Args>
+    Page* newPage(Args&&... args)
+    {
+        Page* page = PageTraits::allocate(m_allocator, 1);
+        try
+        {
+            PageTraits::construct(m_allocator, page, std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            PageTraits::deallocate(m_allocator, page, 1);
+            throw;
+        }
+        ++m_numAllocations;
+        ++m_numPages;
+        return page;
+    }
+
+    void destroyPage(Page* page)
+    {
+        --m_numPages;
+        PageTraits::destroy(m_allocator, page);
+        PageTraits::deallocate(m_allocator, page, 1);
+    }
+
+    Page* findPage(std::size_t index) const
+    {
+        std::size_t pageNum = index >> PAGE_BITS;
+        if (pageNum < DENSE_PAGES)
+        {
+            if (pageNum < m_densePages.size())
+            {
+                return m_densePages[pageNum];
+            }
+            return nullptr;
+        }
+
+        auto it = m_sparsePages.find(pageNum);
+        if (it == m_sparsePages.end())
+        {
+            return nullptr;
+        }
+        return it->second;
+    }
+
+    Page& getOrCreatePage(std::size_t index)
+    {
+        std::size_t pageNum = index >> PAGE_BITS;
+        if (pageNum < DENSE_PAGES)
+        {
+            if (pageNum >= m_densePages.size())
+            {
+                m_densePages.resize(pageNum + 1);
+            }
+            Page*& slot = m_densePages[pageNum];
+            if (slot == nullptr)
+            {
+                slot = newPage();
+            }
+            return *slot;
+        }
+
+        // the page is allocated before its entry goes in, so a failure leaves no null entry behind
+        auto it = m_sparsePages.find(pageNum);
+        if (it != m_sparsePages.end())
+        {
+            return *it->second;
+        }
+        Page* page = newPage();
+        try
+        {
+            m_sparsePages.emplace(pageNum, page);
+        }
+        catch (...)
+        {
+            destroyPage(page);
+            throw;
+        }
+        return *page;
+    }
+
+    void releasePage(std::size_t pageNum)
+    {
+        if (pageNum < DENSE_PAGES)
+        {
+            destroyPage(m_densePages[pageNum]);
+            m_densePages[pageNum] = nullptr;
+            // trim the table so a tree that shrank doesn't keep a long run of empty entries around
+            while (!m_densePages.empty() && m_densePages.back() == nullptr)
+            {
+                m_densePages.pop_back();
+            }
+        }
+        else
+        {
+            auto it = m_sparsePages.find(pageNum);
+            destroyPage(it->second);
+            m_sparsePages.erase(it);
+        }
+    }
+
+    void copyFrom(const PagedSlots& other)
+    {
+        m_densePages.resize(other.m_densePages.size(), nullptr);
+        for (std::size_t ii = 0; ii < other.m_densePages.size(); ++ii)
+        {
+            if (other.m_densePages[ii] != nullptr)
+            {
+                m_densePages[ii] = newPage(*other.m_densePages[ii]);
+            }
+        }
+        for (const auto& entry : other.m_sparsePages)
+        {
+            Page* page = newPage(*entry.second);
+            m_sparsePages[entry.first] = page;
+        }
+        m_numOccupied = other.m_numOccupied;
+    }
+};
+
+#endif
@@ -0,0 +1,471 @@
+// SIMD SEARCH
+// -Vectorized lower bound kernels over the padded Eytzinger array of a FrozenSearchTree, for signed 32
+//      and 64 bit integers, floats and doubles compared with their natural < ordering
+// -lowerBoundSlot resolves several levels per step. From slot k it loads the children 2k..2k+1, the
+//      grandchildren 4k..4k+3 and, for 32 bit keys, the great-grandchildren 8k..8k+7 with no dependency
+//      on k's own comparison, compares the probe against each group at once and then picks the path
+//      out of the resulting bit masks. That's 3 levels per step for 64 bit keys and 4 for 32 bit keys
+// -lowerBoundBatch runs 4/8 (AVX2) or 8/16 (AVX-512) probes side by side, one per vector lane. Every
+//      lane gathers the key of its own slot, so near the root they all compare against the same node
+// -Kernels are compiled with target attributes and picked at runtime from the CPU's features, with a
+//      plain scalar descent as the fallback. Other key types always take the scalar path
+// -Both return Eytzinger slots exactly like FrozenSearchTree::lowerBoundSlot(), 0 meaning "past the end"
+#ifndef __SIMD_SEARCH__
+#define __SIMD_SEARCH__
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SIMD_SEARCH_X86 1
+#include <immintrin.h>
+#endif
+
+enum class SimdKind { None, Int32, Int64, Float, Double };
+
+template<typename T>
+struct SimdKindOf
+{
+    static const SimdKind value =
+        std::is_same<T, float>::value ? SimdKind::Float :
+        std::is_same<T, double>::value ? SimdKind::Double :
+        (std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) == 4) ? SimdKind::Int32 :
+        (std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) == 8) ? SimdKind::Int64 :
+        SimdKind::None;
+};
+
+template<SimdKind K> struct SimdKindTag {};
+
+// the shared scalar pieces of every descent
+struct EytzingerSteps
+{
+    template<typename T>
+    static std::size_t descend(const T* keys, std::size_t k, int levels, const T& value)
+    {
+        for (int level = 0; level < levels; ++level)
+        {
+            k = k * 2 + static_cast<std::size_t>(keys[k] < value);
+        }
+        return k;
+    }
+
+    // drops the trailing right turns plus the last left turn, see FrozenSearchTree::lowerBoundSlot()
+    static std::size_t finish(std::size_t k)
+    {
+        return k >> __builtin_ffsll(static_cast<long long>(~k));
+    }
+};
+
+struct CpuFeatures
+{
+    static bool avx2()
+    {
+#ifdef SIMD_SEARCH_X86
+        static const bool has = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") != 0);
+        return has;
+#else
+        return false;
+#endif
+    }
+
+    static bool avx512()
+    {
+#ifdef SIMD_SEARCH_X86
+        static const bool has = (__builtin_cpu_init(), __builtin_cpu_supports("avx512f") != 0);
+        return has;
+#else
+        return false;
+#endif
+    }
+};
+
+template<typename T, SimdKind K = SimdKindOf<T>::value>
+class SimdSearch
+{
+public:
+    static const bool available = false;
+
+    static std::size_t lowerBoundSlot(const T* keys, int height, const T& value)
+    {
+        return EytzingerSteps::finish(EytzingerSteps::descend(keys, 1, height, value));
+    }
+
+    static void lowerBoundBatch(const T* keys, int height, const T* values, std::size_t count,
+                                std::size_t* out)
+    {
+        for (std::size_t ii = 0; ii < count; ++ii)
+        {
+            out[ii] = lowerBoundSlot(keys, height, values[ii]);
+        }
+    }
+};
+
+#ifdef SIMD_SEARCH_X86
+
+// Per key type vector primitives. lessMaskN returns a mask whose bit i is set when p[i] < value, and
+// the batch kernels advance every lane's slot k to 2k + (keys[k] < probe). The AVX-512 gathers use the
+// masked form with every lane enabled, the unmasked ones trip -Wmaybe-uninitialized inside GCC's headers
+struct SimdOps
+{
+    // ---- 64 bit integers ----
+    __attribute__((target("avx2")))
+    static unsigned lessMask4(const void* p, std::int64_t value, SimdKindTag<SimdKind::Int64>)
+    {
+        __m256i keys = _mm256_loadu_si256(static_cast<const __m256i*>(p));
+        __m256i less = _mm256_cmpgt_epi64(_mm256_set1_epi64x(value), keys);
+        return _mm256_movemask_pd(_mm256_castsi256_pd(less));
+    }
+
+    __attribute__((target("avx2")))
+    static void batch4(const void* keys, int height, const void* values, std::size_t* out,
+                       SimdKindTag<SimdKind::Int64>)
+    {
+        const long long* base = static_cast<const long long*>(keys);
+        __m256i probes = _mm256_loadu_si256(static_cast<const __m256i*>(values));
+        __m256i slots = _mm256_set1_epi64x(1);
+        for (int level = 0; level < height; ++level)
+        {
+            __m256i nodeKeys = _mm256_i64gather_epi64(base, slots, 8);
+            // all ones where the node is less than the probe, so subtracting it adds 1
+            __m256i less = _mm256_cmpgt_epi64(probes, nodeKeys);
+            slots = _mm256_sub_epi64(_mm256_add_epi64(slots, slots), less);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), slots);
+    }
+
+    __attribute__((target("avx512f")))
+    static void batch8(const void* keys, int height, const void* values, std::size_t* out,
+                       SimdKindTag<SimdKind::Int64>)
+    {
+        __m512i probes = _mm512_loadu_si512(values);
+        __m512i slots = _mm512_set1_epi64(1);
+        __m512i one = _mm512_set1_epi64(1);
+        for (int level = 0; level < height; ++level)
+        {
+            __m512i nodeKeys = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), 0xFF, slots, keys, 8);
+            __mmask8 less = _mm512_cmplt_epi64_mask(nodeKeys, probes);
+            slots = _mm512_add_epi64(slots, slots);
+            slots = _mm512_mask_add_epi64(slots, less, slots, one);
+        }
+        _mm512_storeu_si512(out, slots);
+    }
+
+    // ---- doubles ----
+    __attribute__((target("avx2")))
+    static unsigned lessMask4(const void* p, double value, SimdKindTag<SimdKind::Double>)
+    {
+        __m256d keys = _mm256_loadu_pd(static_cast<const double*>(p));
+        return _mm256_movemask_pd(_mm256_cmp_pd(keys, _mm256_set1_pd(value), _CMP_LT_OQ));
+    }
+
+    __attribute__((target("avx2")))
+    static void batch4(const void* keys, int height, const void* values, std::size_t* out,
+                       SimdKindTag<SimdKind::Double>)
+    {
+        const double* base = static_cast<const double*>(keys);
+        __m256d probes = _mm256_loadu_pd(static_cast<const double*>(values));
+        __m256i slots = _mm256_set1_epi64x(1);
+        for (int level = 0; level < height; ++level)
+        {
+            __m256d nodeKeys = _mm256_i64gather_pd(base, slots, 8);
+            __m256i less = _mm256_castpd_si256(_mm256_cmp_pd(nodeKeys, probes, _CMP_LT_OQ));
+            slots = _mm256_sub_epi64(_mm256_add_epi64(slots, slots), less);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), slots);
+    }
+
+    __attribute__((target("avx512f")))
+    static void batch8(const void* keys, int height, const void* values, std::size_t* out,
+                       SimdKindTag<SimdKind::Double>)
+    {
+        __m512d probes = _mm512_loadu_pd(values);
+        __m512i slots = _mm512_set1_epi64(1);
+        __m512i one = _mm512_set1_epi64(1);
+        for (int level = 0; level < height; ++level)
+        {
+            __m512d nodeKeys = _mm512_mask_i64gather_pd(_mm512_setzero_pd(), 0xFF, slots, keys, 8);
+            __mmask8 less = _mm512_cmp_pd_mask(nodeKeys, probes, _CMP_LT_OQ);
+            slots = _mm512_add_epi64(slots, slots);
+            slots = _mm512_mask_add_epi64(slots, less, slots, one);
+        }
+        _mm512_storeu_si512(out, slots);
+    }
+
+    // ---- 32 bit integers ----
+    __attribute__((target("avx2")))
+    static unsigned lessMask4(const void* p, std::int32_t value, SimdKindTag<SimdKind::Int32>)
+    {
+        __m128i keys = _mm_loadu_si128(static_cast<const __m128i*>(p));
+        __m128i less = _mm_cmpgt_epi32(_mm_set1_epi32(value), keys);
+        return _mm_movemask_ps(_mm_castsi128_ps(less));
+    }
+
+    __attribute__((target("avx2")))
+    static unsigned lessMask8(const void* p, std::int32_t value, SimdKindTag<SimdKind::Int32>)
+    {
+        __m256i keys = _mm256_loadu_si256(static_cast<const __m256i*>(p));
+        __m256i less = _mm256_cmpgt_epi32(_mm256_set1_epi32(value), keys);
+        return _mm256_movemask_ps(_mm256_castsi256_ps(less));
+    }
+
+    // 32 bit lanes hold the slots, which is why the caller keeps these to trees of at most 30 levels
+    __attribute__((target("avx2")))
+    static void batch8(const void* keys, int height, const void* values, std::size_t* out,
+                       SimdKindTag<SimdKind::Int32>)
+    {
+        const int* base = static_cast<const int*>(keys);
+        __m256i probes = _mm256_loadu_si256(static_cast<const __m256i*>(values));
+        __m256i slots = _mm256_set1_epi32(1);
+        for (int level = 0; level < height; ++level)
+        {
+            __m256i nodeKeys = _mm256_i32gather_epi32(base, slots, 4);
+            __m256i less = _mm256_cmpgt_epi32(probes, nodeKeys);
+            slots = _mm256_sub_epi32(_mm256_add_epi32(slots, slots), less);
+        }
+        storeSlots(slots, out);
+    }
+
+    __attribute__((target("avx512f")))
+    static void batch16(const void* keys, int height, const void* values, std::size_t* out,
+                        SimdKindTag<SimdKind::Int32>)
+    {
+        __m512i probes = _mm512_loadu_si512(values);
+        __m512i slots = _mm512_set1_epi32(1);
+        __m512i one = _mm512_set1_epi32(1);
+        for (int level = 0; level < height; ++level)
+        {
+            __m512i nodeKeys = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF, slots, keys, 4);
+            __mmask16 less = _mm512_cmplt_epi32_mask(nodeKeys, probes);
+            slots = _mm512_add_epi32(slots, slots);
+            slots = _mm512_mask_add_epi32(slots, less, slots, one);
+        }
+        storeSlots(slots, out);
+    }
+
+    // ---- floats ----
+    __attribute__((target("avx2")))
+    static unsigned lessMask4(const void* p, float value, SimdKindTag<SimdKind::Float>)
+    {
+        __m128 keys = _mm_loadu_ps(static_cast<const float*>(p));
+        return _mm_movemask_ps(_mm_cmplt_ps(keys, _mm_set1_ps(value)));
+    }
+
+    __attribute__((target("avx2")))
+    static unsigned lessMask8(const void* p, float value, SimdKindTag<SimdKind::Float>)
+    {
+        __m256 keys = _mm256_loadu_ps(static_cast<const float*>(p));
+        return _mm256_movemask_ps(_mm256_cmp_ps(keys, _mm256_set1_ps(value), _CMP_LT_OQ));
+    }
+
+    __attribute__((target("avx2")))
+    static void batch8(const void* keys, int height, const void* values, std::size_t* out,
+                       SimdKindTag<SimdKind::Float>)
+    {
+        const float* base = static_cast<const float*>(keys);
+        __m256 probes = _mm256_loadu_ps(static_cast<const float*>(values));
+        __m256i slots = _mm256_set1_epi32(1);
+        for (int level = 0; level < height; ++level)
+        {
+            __m256 nodeKeys = _mm256_i32gather_ps(base, slots, 4);
+            __m256i less = _mm256_castps_si256(_mm256_cmp_ps(nodeKeys, probes, _CMP_LT_OQ));
+            slots = _mm256_sub_epi32(_mm256_add_epi32(slots, slots), less);
+        }
+        storeSlots(slots, out);
+    }
+
+    __attribute__((target("avx512f")))
+    static void batch16(const void* keys, int height, const void* values, std::size_t* out,
+                        SimdKindTag<SimdKind::Float>)
+    {
+        __m512 probes = _mm512_loadu_ps(values);
+        __m512i slots = _mm512_set1_epi32(1);
+        __m512i one = _mm512_set1_epi32(1);
+        for (int level = 0; level < height; ++level)
+        {
+            __m512 nodeKeys = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF, slots, keys, 4);
+            __mmask16 less = _mm512_cmp_ps_mask(nodeKeys, probes, _CMP_LT_OQ);
+            slots = _mm512_add_epi32(slots, slots);
+            slots = _mm512_mask_add_epi32(slots, less, slots, one);
+        }
+        storeSlots(slots, out);
+    }
+
+private:
+    __attribute__((target("avx2")))
+    static void storeSlots(__m256i slots, std::size_t* out)
+    {
+        std::uint32_t lanes[8];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), slots);
+        for (int ii = 0; ii < 8; ++ii)
+        {
+            out[ii] = lanes[ii];
+        }
+    }
+
+    __attribute__((target("avx512f")))
+    static void storeSlots(__m512i slots, std::size_t* out)
+    {
+        std::uint32_t lanes[16];
+        _mm512_storeu_si512(lanes, slots);
+        for (int ii = 0; ii < 16; ++ii)
+        {
+            out[ii] = lanes[ii];
+        }
+    }
+};
+
+// 64 bit keys: 3 levels per step, 4 (AVX2) or 8 (AVX-512) probes per batch
+template<typename T>
+class SimdSearch64
+{
+public:
+    static const bool available = true;
+    static const int LEVELS_PER_STEP = 3;
+
+    static std::size_t lowerBoundSlot(const T* keys, int height, const T& value)
+    {
+        if (CpuFeatures::avx2())
+        {
+            return lowerBoundSlotAvx2(keys, height, value);
+        }
+        return EytzingerSteps::finish(EytzingerSteps::descend(keys, 1, height, value));
+    }
+
+    static void lowerBoundBatch(const T* keys, int height, const T* values, std::size_t count,
+                                std::size_t* out)
+    {
+        Tag tag;
+        std::size_t done = 0;
+        if (CpuFeatures::avx512())
+        {
+            for (; done + 8 <= count; done += 8)
+            {
+                SimdOps::batch8(keys, height, values + done, out + done, tag);
+            }
+        }
+        else if (CpuFeatures::avx2())
+        {
+            for (; done + 4 <= count; done += 4)
+            {
+                SimdOps::batch4(keys, height, values + done, out + done, tag);
+            }
+        }
+        for (std::size_t ii = 0; ii < done; ++ii)
+        {
+            out[ii] = EytzingerSteps::finish(out[ii]);
+        }
+        for (; done < count; ++done)
+        {
+            out[done] = lowerBoundSlot(keys, height, values[done]);
+        }
+    }
+
+private:
+    typedef SimdKindTag<SimdKindOf<T>::value> Tag;
+
+    __attribute__((target("avx2")))
+    static std::size_t lowerBoundSlotAvx2(const T* keys, int height, const T& value)
+    {
+        std::size_t k = 1;
+        int level = 0;
+        for (; level + LEVELS_PER_STEP <= height; level += LEVELS_PER_STEP)
+        {
+            // none of these loads wait on a comparison, the path is picked from the masks afterwards
+            unsigned d0 = keys[k] < value;
+            unsigned children = (keys[2 * k] < value) | (unsigned(keys[2 * k + 1] < value) << 1);
+            unsigned grandchildren = SimdOps::lessMask4(&keys[4 * k], value, Tag());
+            unsigned d1 = (children >> d0) & 1;
+            unsigned d2 = (grandchildren >> (2 * d0 + d1)) & 1;
+            k = 8 * k + 4 * d0 + 2 * d1 + d2;
+        }
+        return EytzingerSteps::finish(EytzingerSteps::descend(keys, k, height - level, value));
+    }
+};
+
+// 32 bit keys: 4 levels per step, 8 (AVX2) or 16 (AVX-512) probes per batch
+template<typename T>
+class SimdSearch32
+{
+public:
+    static const bool available = true;
+    static const int LEVELS_PER_STEP = 4;
+    // the batch kernels keep slots in 32 bit lanes, and gather indices are signed
+    static const int MAX_BATCH_HEIGHT = 30;
+
+    static std::size_t lowerBoundSlot(const T* keys, int height, const T& value)
+    {
+        if (CpuFeatures::avx2())
+        {
+            return lowerBoundSlotAvx2(keys, height, value);
+        }
+        return EytzingerSteps::finish(EytzingerSteps::descend(keys, 1, height, value));
+    }
+
+    static void lowerBoundBatch(const T* keys, int height, const T* values, std::size_t count,
+                                std::size_t* out)
+    {
+        Tag tag;
+        std::size_t done = 0;
+        if (height <= MAX_BATCH_HEIGHT && CpuFeatures::avx512())
+        {
+            for (; done + 16 <= count; done += 16)
+            {
+                SimdOps::batch16(keys, height, values + done, out + done, tag);
+            }
+        }
+        else if (height <= MAX_BATCH_HEIGHT && CpuFeatures::avx2())
+        {
+            for (; done + 8 <= count; done += 8)
+            {
+                SimdOps::batch8(keys, height, values + done, out + done, tag);
+            }
+        }
+        for (std::size_t ii = 0; ii < done; ++ii)
+        {
+            out[ii] = EytzingerSteps::finish(out[ii]);
+        }
+        for (; done < count; ++done)
+        {
+            out[done] = lowerBoundSlot(keys, height, values[done]);
+        }
+    }
+
+private:
+    typedef SimdKindTag<SimdKindOf<T>::value> Tag;
+
+    __attribute__((target("avx2")))
+    static std::size_t lowerBoundSlotAvx2(const T* keys, int height, const T& value)
+    {
+        std::size_t k = 1;
+        int level = 0;
+        for (; level + LEVELS_PER_STEP <= height; level += LEVELS_PER_STEP)
+        {
+            unsigned d0 = keys[k] < value;
+            unsigned children = (keys[2 * k] < value) | (unsigned(keys[2 * k + 1] < value) << 1);
+            unsigned grandchildren = SimdOps::lessMask4(&keys[4 * k], value, Tag());
+            unsigned greatGrandchildren = SimdOps::lessMask8(&keys[8 * k], value, Tag());
+            unsigned d1 = (children >> d0) & 1;
+            unsigned d2 = (grandchildren >> (2 * d0 + d1)) & 1;
+            unsigned d3 = (greatGrandchildren >> (4 * d0 + 2 * d1 + d2)) & 1;
+            k = 16 * k + 8 * d0 + 4 * d1 + 2 * d2 + d3;
+        }
+        return EytzingerSteps::finish(EytzingerSteps::descend(keys, k, height - level, value));
+    }
+};
+
+template<typename T>
+class SimdSearch<T, SimdKind::Int64> : public SimdSearch64<T> {};
+
+template<typename T>
+class SimdSearch<T, SimdKind::Double> : public SimdSearch64<T> {};
+
+template<typename T>
+class SimdSearch<T, SimdKind::Int32> : public SimdSearch32<T> {};
+
+template<typename T>
+class SimdSearch<T, SimdKind::Float> : public SimdSearch32<T> {};
+
+#endif
+
+#endif
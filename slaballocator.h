@@ -0,0 +1,266 @@
+// SLAB ALLOCATOR
+// -Standard allocator for containers that allocate one object at a time, like the pages of PagedSlots
+// -Single objects are carved out of large slabs of blocksPerSlab blocks. A freed block goes on an
+//      intrusive free list (the link is stored in the dead block itself), so steady churn never gets
+//      back to malloc once the slabs are warm
+// -Requests for more than one object go straight to operator new
+// -Slabs are only returned all at once: by release(), or when the last copy of the allocator goes away.
+//      release() skips the pools that still have blocks out, so a tree sharing the arena with another
+//      can still release what it was using
+// -Copies share one arena, and so do allocators rebound from them: the arena keeps a pool per block
+//      size, so a rebound copy compares equal to the allocator it came from and either can free what the
+//      other allocated. The arena isn't locked, so it must only be used from one thread at a time.
+//      Copying a container gives the copy a fresh arena (select_on_container_copy_construction), so two
+//      trees never end up sharing one by accident
+//
+// Functions
+//    1) allocate / deallocate
+//    2) release
+//    3) numSlabs
+#ifndef __SLAB_ALLOCATOR__
+#define __SLAB_ALLOCATOR__
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// fixed size block pool behind SlabAllocator
+class SlabPool
+{
+public:
+    SlabPool(std::size_t blockSize, std::size_t blocksPerSlab)
+        : m_blockSize(blockSize), m_blocksPerSlab(blocksPerSlab), m_freeList(nullptr), m_numLive(0)
+    {
+    }
+
+    ~SlabPool()
+    {
+        freeSlabs();
+    }
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    void* allocate()
+    {
+        if (m_freeList == nullptr)
+        {
+            grow();
+        }
+        FreeBlock* block = m_freeList;
+        m_freeList = block->m_next;
+        ++m_numLive;
+        return block;
+    }
+
+    void deallocate(void* pointer)
+    {
+        FreeBlock* block = static_cast<FreeBlock*>(pointer);
+        block->m_next = m_freeList;
+        m_freeList = block;
+        --m_numLive;
+    }
+
+    // every block has to be back already
+    void release()
+    {
+        if (m_numLive != 0)
+        {
+            throw std::logic_error( "Cannot release slabs while blocks from them are still in use" );
+        }
+        freeSlabs();
+    }
+
+    std::size_t blockSize() const { return m_blockSize; }
+    std::size_t blocksPerSlab() const { return m_blocksPerSlab; }
+    std::size_t numSlabs() const { return m_slabs.size(); }
+    std::size_t numLive() const { return m_numLive; }
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock* m_next;
+    };
+
+    std::size_t m_blockSize;
+    std::size_t m_blocksPerSlab;
+    FreeBlock* m_freeList;
+    std::size_t m_numLive;
+    std::vector<char*> m_slabs;
+
+    // new blocks are linked so they come back out in address order
+    void grow()
+    {
+        m_slabs.reserve(m_slabs.size() + 1);
+        char* slab = static_cast<char*>(::operator new(m_blockSize * m_blocksPerSlab));
+        m_slabs.push_back(slab);
+        for (std::size_t ii = m_blocksPerSlab; ii > 0; --ii)
+        {
+            FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + (ii - 1) * m_blockSize);
+            block->m_next = m_freeList;
+            m_freeList = block;
+        }
+    }
+
+    void freeSlabs()
+    {
+        for (char* slab : m_slabs)
+        {
+            ::operator delete(slab);
+        }
+        m_slabs.clear();
+        m_freeList = nullptr;
+    }
+};
+
+// the pools behind one SlabAllocator and everything rebound from it, one per block size
+class SlabArena
+{
+public:
+    explicit SlabArena(std::size_t blocksPerSlab): m_blocksPerSlab(blocksPerSlab)
+    {
+    }
+
+    SlabArena(const SlabArena&) = delete;
+    SlabArena& operator=(const SlabArena&) = delete;
+
+    // there are only ever as many pools as types the allocator is rebound to, so a scan is enough
+    SlabPool* pool(std::size_t blockSize)
+    {
+        for (const std::unique_ptr<SlabPool>& pool : m_pools)
+        {
+            if (pool->blockSize() == blockSize)
+            {
+                return pool.get();
+            }
+        }
+        m_pools.emplace_back(new SlabPool(blockSize, m_blocksPerSlab));
+        return m_pools.back().get();
+    }
+
+    // frees the slabs of every pool that has no blocks out, the others are left alone
+    void release()
+    {
+        for (const std::unique_ptr<SlabPool>& pool : m_pools)
+        {
+            if (pool->numLive() == 0)
+            {
+                pool->release();
+            }
+        }
+    }
+
+    std::size_t blocksPerSlab() const { return m_blocksPerSlab; }
+
+    std::size_t numSlabs() const
+    {
+        std::size_t numSlabs = 0;
+        for (const std::unique_ptr<SlabPool>& pool : m_pools)
+        {
+            numSlabs += pool->numSlabs();
+        }
+        return numSlabs;
+    }
+
+private:
+    std::size_t m_blocksPerSlab;
+    std::vector<std::unique_ptr<SlabPool> > m_pools;
+};
+
+template<typename T>
+class SlabAllocator
+{
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_move_assignment;
+
+    static const std::size_t DEFAULT_BLOCKS_PER_SLAB = 64;
+
+    explicit SlabAllocator(std::size_t blocksPerSlab = DEFAULT_BLOCKS_PER_SLAB)
+        : m_arena(std::make_shared<SlabArena>(blocksPerSlab)), m_pool(m_arena->pool(blockSize()))
+    {
+    }
+
+    // shares the arena, and takes the pool for T's block size from it
+    template<typename U>
+    SlabAllocator(const SlabAllocator<U>& other)
+        : m_arena(other.m_arena), m_pool(m_arena->pool(blockSize()))
+    {
+    }
+
+    SlabAllocator select_on_container_copy_construction() const
+    {
+        return SlabAllocator(m_arena->blocksPerSlab());
+    }
+
+    T* allocate(std::size_t count)
+    {
+        if (count != 1)
+        {
+            return static_cast<T*>(::operator new(count * sizeof(T)));
+        }
+        return static_cast<T*>(m_pool->allocate());
+    }
+
+    void deallocate(T* pointer, std::size_t count)
+    {
+        if (count != 1)
+        {
+            ::operator delete(pointer);
+            return;
+        }
+        m_pool->deallocate(pointer);
+    }
+
+    // hands back the slabs of every block size that has nothing allocated from it right now, including
+    // through other allocators sharing the arena
+    void release()
+    {
+        m_arena->release();
+    }
+
+    // slabs held by the arena, for every block size
+    std::size_t numSlabs() const
+    {
+        return m_arena->numSlabs();
+    }
+
+    template<typename U>
+    bool operator==(const SlabAllocator<U>& other) const { return m_arena == other.m_arena; }
+    template<typename U>
+    bool operator!=(const SlabAllocator<U>& other) const { return m_arena != other.m_arena; }
+
+private:
+    template<typename U> friend class SlabAllocator;
+
+    static_assert(alignof(T) <= alignof(std::max_align_t), "SlabAllocator doesn't support over-aligned types");
+
+    std::shared_ptr<SlabArena> m_arena;
+    SlabPool* m_pool; // owned by m_arena
+
+    // big enough for the free list link, and rounded up so every block in a slab stays aligned for T
+    static std::size_t blockSize()
+    {
+        std::size_t size = sizeof(T) < sizeof(void*) ? sizeof(void*) : sizeof(T);
+        std::size_t align = alignof(T) < alignof(void*) ? alignof(void*) : alignof(T);
+        return (size + align - 1) / align * align;
+    }
+};
+
+// lets a container give memory its allocator is holding on to back to the system. Only SlabAllocator
+// keeps any
+template<typename Allocator>
+void releaseSlabs(Allocator&)
+{
+}
+
+template<typename T>
+void releaseSlabs(SlabAllocator<T>& allocator)
+{
+    allocator.release();
+}
+
+#endif
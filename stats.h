@@ -0,0 +1,292 @@
+// TREE STATS
+// -Compile-time instrumentation policies for MySearchTree, its fourth template parameter
+// -NoStats (the default) has no state and every hook is an empty inline function, so an uninstrumented
+//      tree compiles to exactly the code it would have without hooks, and the empty base takes no space
+// -CountingStats counts, with relaxed atomics so the const read path stays safe for concurrent readers:
+//      comparator calls, findIndex() descents and the levels they went down, swap steps in remove()
+//      and extract(), and the number and total time of balance() calls. Every LATENCY_SAMPLE_EVERY-th
+//      insert, remove and lookup is also timed into a log2 latency histogram for its kind
+// -Page allocations and their bytes are counted by the slot storage (see PagedSlots), so stats()
+//      reports them under any policy
+// -MySearchTree::stats() returns a TreeStats snapshot
+//
+// Functions
+//    1) TreeStats (snapshot), LatencyHistogram (buckets, count, percentile)
+//    2) NoStats / CountingStats (the policies)
+#ifndef __TREE_STATS__
+#define __TREE_STATS__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// one in this many operations of each kind is timed by CountingStats
+static const std::uint64_t LATENCY_SAMPLE_EVERY = 16;
+static const int LATENCY_BUCKETS = 64;
+
+enum StatOp
+{
+    STAT_INSERT,
+    STAT_REMOVE,
+    STAT_LOOKUP, // contains, rank and size
+    NUM_STAT_OPS
+};
+
+// bucket b holds latencies in [2^b, 2^(b+1)) nanoseconds, bucket 0 also holds 0
+struct LatencyHistogram
+{
+    LatencyHistogram()
+    {
+        for (int ii = 0; ii < LATENCY_BUCKETS; ++ii)
+        {
+            m_buckets[ii] = 0;
+        }
+    }
+
+    std::uint64_t count() const
+    {
+        std::uint64_t total = 0;
+        for (int ii = 0; ii < LATENCY_BUCKETS; ++ii)
+        {
+            total += m_buckets[ii];
+        }
+        return total;
+    }
+
+    // upper edge of the bucket holding the given fraction (0 to 1) of samples, in nanoseconds
+    std::uint64_t percentile(double fraction) const
+    {
+        std::uint64_t total = count();
+        std::uint64_t seen = 0;
+        for (int ii = 0; ii < LATENCY_BUCKETS; ++ii)
+        {
+            seen += m_buckets[ii];
+            if (seen > 0 && seen >= fraction * total)
+            {
+                return (ii == LATENCY_BUCKETS - 1) ? UINT64_MAX : (std::uint64_t(2) << ii) - 1;
+            }
+        }
+        return 0;
+    }
+
+    static int bucketOf(std::uint64_t nanos)
+    {
+        return (nanos == 0) ? 0 : 63 - __builtin_clzll(nanos);
+    }
+
+    std::uint64_t m_buckets[LATENCY_BUCKETS];
+};
+
+struct TreeStats
+{
+    TreeStats()
+        : m_comparisons(0), m_descents(0), m_levelsDescended(0), m_maxDepth(0), m_removeSwaps(0),
+          m_balances(0), m_balanceNanos(0), m_pageAllocations(0), m_bytesAllocated(0)
+    {
+    }
+
+    std::uint64_t m_comparisons;
+    std::uint64_t m_descents; // findIndex() calls
+    std::uint64_t m_levelsDescended; // over all of them; divide by m_descents for the average
+    std::uint64_t m_maxDepth;
+    std::uint64_t m_removeSwaps;
+    std::uint64_t m_balances;
+    std::uint64_t m_balanceNanos;
+    std::uint64_t m_pageAllocations;
+    std::uint64_t m_bytesAllocated;
+    LatencyHistogram m_latency[NUM_STAT_OPS];
+};
+
+class NoStats
+{
+public:
+    static const bool ENABLED = false;
+
+    class Timer
+    {
+    public:
+        Timer(const NoStats&, StatOp) {}
+    };
+
+    class BalanceTimer
+    {
+    public:
+        explicit BalanceTimer(const NoStats&) {}
+    };
+
+    void onCompare() const {}
+    void onDescent(std::uint64_t) const {}
+    void onRemoveSwap() const {}
+
+    TreeStats snapshot() const
+    {
+        return TreeStats();
+    }
+};
+
+class CountingStats
+{
+public:
+    static const bool ENABLED = true;
+
+    // times its own lifetime into the histogram for op, if this operation is one of the sampled ones
+    class Timer
+    {
+    public:
+        Timer(const CountingStats& stats, StatOp op): m_stats(stats), m_op(op), m_start(0)
+        {
+            if (stats.m_numOps[op].fetch_add(1, std::memory_order_relaxed) % LATENCY_SAMPLE_EVERY == 0)
+            {
+                m_start = nowNanos();
+            }
+        }
+
+        ~Timer()
+        {
+            if (m_start != 0)
+            {
+                int bucket = LatencyHistogram::bucketOf(nowNanos() - m_start);
+                m_stats.m_latency[m_op][bucket].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+
+    private:
+        const CountingStats& m_stats;
+        StatOp m_op;
+        std::uint64_t m_start; // 0 when not sampled
+    };
+
+    // adds its own lifetime to the balance() time
+    class BalanceTimer
+    {
+    public:
+        explicit BalanceTimer(const CountingStats& stats): m_stats(stats), m_start(nowNanos()) {}
+
+        ~BalanceTimer()
+        {
+            m_stats.m_balances.fetch_add(1, std::memory_order_relaxed);
+            m_stats.m_balanceNanos.fetch_add(nowNanos() - m_start, std::memory_order_relaxed);
+        }
+
+        BalanceTimer(const BalanceTimer&) = delete;
+        BalanceTimer& operator=(const BalanceTimer&) = delete;
+
+    private:
+        const CountingStats& m_stats;
+        std::uint64_t m_start;
+    };
+
+    CountingStats()
+    {
+        reset();
+    }
+
+    // a copy of a tree carries its history along, eg. from one VersionedSearchTree version to the next
+    CountingStats(const CountingStats& other)
+    {
+        copyFrom(other);
+    }
+
+    CountingStats& operator=(const CountingStats& other)
+    {
+        copyFrom(other);
+        return *this;
+    }
+
+    void onCompare() const
+    {
+        m_comparisons.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void onDescent(std::uint64_t levels) const
+    {
+        m_descents.fetch_add(1, std::memory_order_relaxed);
+        m_levelsDescended.fetch_add(levels, std::memory_order_relaxed);
+        std::uint64_t deepest = m_maxDepth.load(std::memory_order_relaxed);
+        while (levels > deepest && !m_maxDepth.compare_exchange_weak(deepest, levels, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void onRemoveSwap() const
+    {
+        m_removeSwaps.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    TreeStats snapshot() const
+    {
+        TreeStats stats;
+        stats.m_comparisons = m_comparisons.load(std::memory_order_relaxed);
+        stats.m_descents = m_descents.load(std::memory_order_relaxed);
+        stats.m_levelsDescended = m_levelsDescended.load(std::memory_order_relaxed);
+        stats.m_maxDepth = m_maxDepth.load(std::memory_order_relaxed);
+        stats.m_removeSwaps = m_removeSwaps.load(std::memory_order_relaxed);
+        stats.m_balances = m_balances.load(std::memory_order_relaxed);
+        stats.m_balanceNanos = m_balanceNanos.load(std::memory_order_relaxed);
+        for (int op = 0; op < NUM_STAT_OPS; ++op)
+        {
+            for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+            {
+                stats.m_latency[op].m_buckets[bucket] = m_latency[op][bucket].load(std::memory_order_relaxed);
+            }
+        }
+        return stats;
+    }
+
+    void reset()
+    {
+        load(TreeStats(), nullptr);
+    }
+
+    static std::uint64_t nowNanos()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    mutable std::atomic<std::uint64_t> m_comparisons;
+    mutable std::atomic<std::uint64_t> m_descents;
+    mutable std::atomic<std::uint64_t> m_levelsDescended;
+    mutable std::atomic<std::uint64_t> m_maxDepth;
+    mutable std::atomic<std::uint64_t> m_removeSwaps;
+    mutable std::atomic<std::uint64_t> m_balances;
+    mutable std::atomic<std::uint64_t> m_balanceNanos;
+    mutable std::atomic<std::uint64_t> m_numOps[NUM_STAT_OPS]; // for picking the sampled operations
+    mutable std::atomic<std::uint64_t> m_latency[NUM_STAT_OPS][LATENCY_BUCKETS];
+
+    void copyFrom(const CountingStats& other)
+    {
+        std::uint64_t numOps[NUM_STAT_OPS];
+        for (int op = 0; op < NUM_STAT_OPS; ++op)
+        {
+            numOps[op] = other.m_numOps[op].load(std::memory_order_relaxed);
+        }
+        load(other.snapshot(), numOps);
+    }
+
+    // numOps may be null for all zeros
+    void load(const TreeStats& stats, const std::uint64_t* numOps)
+    {
+        m_comparisons.store(stats.m_comparisons, std::memory_order_relaxed);
+        m_descents.store(stats.m_descents, std::memory_order_relaxed);
+        m_levelsDescended.store(stats.m_levelsDescended, std::memory_order_relaxed);
+        m_maxDepth.store(stats.m_maxDepth, std::memory_order_relaxed);
+        m_removeSwaps.store(stats.m_removeSwaps, std::memory_order_relaxed);
+        m_balances.store(stats.m_balances, std::memory_order_relaxed);
+        m_balanceNanos.store(stats.m_balanceNanos, std::memory_order_relaxed);
+        for (int op = 0; op < NUM_STAT_OPS; ++op)
+        {
+            m_numOps[op].store((numOps == nullptr) ? 0 : numOps[op], std::memory_order_relaxed);
+            for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket)
+            {
+                m_latency[op][bucket].store(stats.m_latency[op].m_buckets[bucket], std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+#endif
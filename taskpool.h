@@ -0,0 +1,251 @@
+// WORK STEALING POOL
+// -Small fork/join thread pool used to split recursive work, like the median recursion of
+//      MySearchTree::balance(), across cores
+// -invoke(first, second) runs both functions and returns once both are done. second is queued on the
+//      calling thread's deque and first runs right away, so an idle thread can steal second
+// -Every worker owns a deque. It pushes and pops at the back, where the most recently split (and
+//      smallest) pieces of work are, and idle threads steal from the front, where the big ones are
+// -A thread waiting on invoke() doesn't sleep, it keeps running queued tasks until its own is finished,
+//      so nested invokes can't deadlock no matter how few threads there are
+// -Threads that aren't part of the pool share one extra deque
+//
+// Functions
+//    1) invoke
+//    2) size
+#ifndef __TASK_POOL__
+#define __TASK_POOL__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkStealingPool
+{
+public:
+    // numThreads of 0 means one per hardware thread
+    explicit WorkStealingPool(unsigned numThreads = 0): m_stop(false), m_numQueued(0)
+    {
+        if (numThreads == 0)
+        {
+            numThreads = std::thread::hardware_concurrency();
+        }
+        if (numThreads == 0)
+        {
+            numThreads = 1;
+        }
+
+        // the last deque is for threads outside the pool
+        for (unsigned ii = 0; ii <= numThreads; ++ii)
+        {
+            m_queues.emplace_back(new Queue());
+        }
+        for (unsigned ii = 0; ii < numThreads; ++ii)
+        {
+            m_threads.emplace_back([this, ii]() { workerLoop(ii); });
+        }
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_stop = true;
+        }
+        m_wakeUp.notify_all();
+        for (std::thread& thread : m_threads)
+        {
+            thread.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    unsigned size() const
+    {
+        return static_cast<unsigned>(m_threads.size());
+    }
+
+    // runs first and second, possibly at the same time, and returns once both have finished. If either
+    // one throws, the exception is rethrown here after both are done
+    template<typename First, typename Second>
+    void invoke(First&& first, Second&& second)
+    {
+        Task task(std::forward<Second>(second));
+        push(&task);
+
+        std::exception_ptr error;
+        try
+        {
+            first();
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        while (!task.m_done.load(std::memory_order_acquire))
+        {
+            Task* other = take();
+            if (other != nullptr)
+            {
+                run(other);
+            }
+            else
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+        if (task.m_error)
+        {
+            std::rethrow_exception(task.m_error);
+        }
+    }
+
+private:
+    struct Task
+    {
+        template<typename Function>
+        explicit Task(Function&& function): m_function(std::forward<Function>(function)), m_done(false) {}
+
+        std::function<void()> m_function;
+        std::exception_ptr m_error;
+        std::atomic<bool> m_done;
+    };
+
+    struct Queue
+    {
+        std::mutex m_mutex;
+        std::deque<Task*> m_tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue> > m_queues;
+    std::vector<std::thread> m_threads;
+    bool m_stop; // guarded by m_sleepMutex
+    std::atomic<int> m_numQueued;
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wakeUp;
+
+    // the deque the current thread pushes to and pops from first
+    std::size_t ownQueue() const
+    {
+        const WorkStealingPool* pool = currentPool();
+        if (pool == this)
+        {
+            return currentIndex();
+        }
+        return m_queues.size() - 1;
+    }
+
+    static const WorkStealingPool*& currentPool()
+    {
+        static thread_local const WorkStealingPool* pool = nullptr;
+        return pool;
+    }
+
+    static std::size_t& currentIndex()
+    {
+        static thread_local std::size_t index = 0;
+        return index;
+    }
+
+    void push(Task* task)
+    {
+        Queue& queue = *m_queues[ownQueue()];
+        {
+            std::lock_guard<std::mutex> lock(queue.m_mutex);
+            queue.m_tasks.push_back(task);
+        }
+        m_numQueued.fetch_add(1, std::memory_order_release);
+        {
+            // taking the lock orders this notify after a worker that just checked m_numQueued goes to sleep
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+        }
+        m_wakeUp.notify_one();
+    }
+
+    // newest task from our own deque, otherwise the oldest task of someone else's
+    Task* take()
+    {
+        if (m_numQueued.load(std::memory_order_acquire) <= 0)
+        {
+            return nullptr;
+        }
+
+        std::size_t own = ownQueue();
+        {
+            Queue& queue = *m_queues[own];
+            std::lock_guard<std::mutex> lock(queue.m_mutex);
+            if (!queue.m_tasks.empty())
+            {
+                Task* task = queue.m_tasks.back();
+                queue.m_tasks.pop_back();
+                m_numQueued.fetch_sub(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+
+        for (std::size_t offset = 1; offset < m_queues.size(); ++offset)
+        {
+            Queue& queue = *m_queues[(own + offset) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(queue.m_mutex);
+            if (!queue.m_tasks.empty())
+            {
+                Task* task = queue.m_tasks.front();
+                queue.m_tasks.pop_front();
+                m_numQueued.fetch_sub(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    static void run(Task* task)
+    {
+        try
+        {
+            task->m_function();
+        }
+        catch (...)
+        {
+            task->m_error = std::current_exception();
+        }
+        task->m_done.store(true, std::memory_order_release);
+    }
+
+    void workerLoop(std::size_t index)
+    {
+        currentPool() = this;
+        currentIndex() = index;
+
+        while (true)
+        {
+            Task* task = take();
+            if (task != nullptr)
+            {
+                run(task);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_sleepMutex);
+            m_wakeUp.wait(lock, [this]() { return m_stop || m_numQueued.load() > 0; });
+            if (m_stop)
+            {
+                return;
+            }
+        }
+    }
+};
+
+#endif
@@ -1,23 +1,53 @@
 // VECTORIZED TREE
-// -Implemented as a vector of Node pointers
+// -Implemented as an array of Nodes, each holding its key inline
 // -To access a child...
 //	 if it's L, it's located at 2x where x is the index of the parent
 // 	 if it's R, it's located at 2x + 1
-// -Pointers are used because they can be set to null when the vector is resized. Null values indicate
-//      the index is 'open' and can be filled with a new child node
+// -Occupancy is tracked in a separate bitmap. An unset bit indicates the index is 'open' and can be
+//      filled with a new child node. A descent only touches the keys and the bitmap, there is no
+//      pointer to chase per level
+// -Each slot also holds the number of nodes in the subtree rooted there (0 for open slots). It is
+//      updated along the insert/remove path, which keeps rank() and size() logarithmic
+// -The array is stored in fixed size pages that are only allocated once something lands on them
+//      (see pagedslots.h), so a skewed tree doesn't pay for the empty parts of its deep levels
 // -The tree starts at index 1 instead of 0 so that it can support this parent/child data access system
 // 
 // Functions
 //    1) insert
 //    2) remove
 //    3) contains
-//    4) balance
+//    4) balance (optionally spread across a WorkStealingPool)
 //    5) rank
 //    6) size
 //    7) overloaded << for printing
+//    8) freeze (read-only Eytzinger snapshot, see frozentree.h)
+//    9) setAutoBalance (opt-in scapegoat style partial rebuilds on insert)
+//   10) build_from_sorted (O(n) bulk construction, also available as a constructor)
+//   11) contains_batch / find_batch / rank_batch (interleaved lookups of many keys)
+//   12) begin / end / lower_bound / upper_bound / equal_range (in-order iterators)
+//   13) select / count_between (order statistics)
+//   14) emplace / extract (keys are moved in and out, so move-only keys work)
+//   15) clear
+//   16) save / open_mapped (binary image of the slot array, queried in place through mmap)
+//   17) checkpoint / restore (incremental on-disk checkpoints that only write changed pages)
+//   18) open_log / sync_log / close_log (write-ahead log of changes between checkpoints, see wal.h)
+//   19) stats (counters and latency histograms, with an instrumentation policy, see stats.h)
+//   20) shrink_to_fit / setAutoCompact / memory_usage (giving memory back after mass deletes)
+//   21) count (how many times a key is in the tree; more than once only in multiset mode)
+//
+// The comparator is a template parameter (see compare.h). It defaults to a three-way compare built
+// from <, and DynamicSearchTree takes any int(const T&, const T&) callable at runtime instead
+// The allocator is used for the slot pages. SlabAllocator (see slaballocator.h) keeps freed pages on a
+// free list for the next insert or rebuild instead of going back to malloc each time
+// The fourth parameter picks the instrumentation. NoStats compiles every hook away; CountingStats counts
+// comparisons, descent depths, remove swaps and balance time, and samples operation latencies
+// The last parameter decides what happens to repeated keys (see multiplicity.h). UniqueKeys is a set;
+// CountedKeys, also available as MultiSearchTree, is a multiset that keeps a count next to each key
 // 
 // NEW PATTERNS IMPLEMENTED
-// 1) many things are const
+// 1) many things are const. Lookups (contains, rank, size, the batches and freeze) never write to the
+//      tree or allocate, so concurrent readers are safe; see concurrenttree.h for a locked wrapper
+//      and versionedtree.h for readers that never block
 // 2) the templated type is always passed by const ref so it is only ever copied once
 // 
 // Author: Chris Lee
@@ -34,36 +64,113 @@
 #include <functional>
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <string>
 #include <sstream>
+#include <iterator>
+#include <fstream>
+#include <cstdio>
+#include <type_traits>
+
+#include "checkpoint.h"
+#include "compare.h"
+#include "frozentree.h"
+#include "mappedtree.h"
+#include "multiplicity.h"
+#include "pagedslots.h"
+#include "stats.h"
+#include "taskpool.h"
+#include "wal.h"
 
 #define ROOT_INDEX 1
 
-template<typename T> 
-class MySearchTree 
+template<typename T, typename Compare = ThreeWayCompare<T>, typename Allocator = std::allocator<T>,
+         typename Stats = NoStats, typename Keys = UniqueKeys>
+class MySearchTree : private CompareHolder<T, Compare>, private Stats
 {
 private:
-	class Node
+	// the key's count (see multiplicity.h) is an empty base under set semantics
+	class Node : private Keys::Count
 	{
 	public:
+		Node(): m_data() {}
 		Node(const T& value): m_data(value) {}
 		const T& getVal() const { return m_data; }
 
 	private:
-		const T m_data;
+		friend class MySearchTree;
+		T m_data;
 	};
-    struct ValStruct
+
+public: 
+    // Bidirectional in-order iterator. It is just the tree and a slot index: the next key is found
+    // with index arithmetic alone, so walking the tree never allocates. Keys can't be changed through
+    // it. Any insert, remove or rebuild invalidates every iterator
+    class const_iterator
     {
-        ValStruct(std::shared_ptr<Node>& ptr): m_data(ptr->getVal()), m_ptr(ptr) {}
-        const T& m_data;
-        std::shared_ptr<Node> m_ptr;
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const T* pointer;
+        typedef const T& reference;
+
+        const_iterator(): m_tree(nullptr), m_slot(0) {}
+
+        reference operator*() const { return m_tree->valAt(m_slot); }
+        pointer operator->() const { return &m_tree->valAt(m_slot); }
+
+        const_iterator& operator++()
+        {
+            m_slot = m_tree->nextSlot(m_slot);
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator before = *this;
+            ++*this;
+            return before;
+        }
+
+        // decrementing end() gives the largest key
+        const_iterator& operator--()
+        {
+            m_slot = (m_slot == END_SLOT) ? m_tree->rightmost(ROOT_INDEX) : m_tree->prevSlot(m_slot);
+            return *this;
+        }
+
+        const_iterator operator--(int)
+        {
+            const_iterator before = *this;
+            --*this;
+            return before;
+        }
+
+        bool operator==(const const_iterator& other) const { return m_slot == other.m_slot; }
+        bool operator!=(const const_iterator& other) const { return m_slot != other.m_slot; }
+
+    private:
+        friend class MySearchTree;
+        const_iterator(const MySearchTree* tree, std::size_t slot): m_tree(tree), m_slot(slot) {}
+
+        const MySearchTree* m_tree;
+        std::size_t m_slot; // END_SLOT once past the largest key
     };
+    typedef const_iterator iterator;
 
-public: 
-    MySearchTree(std::function<int(T,T)> comparator = cmp): compare(comparator) 
+    MySearchTree(const Compare& comparator = Compare(), const Allocator& allocator = Allocator())
+        : CompareHolder<T, Compare>(comparator), m_slots(allocator), m_alpha(0), m_minOccupancy(0)
     {
-        m_nodePtrs.resize(2);
-        m_nodePtrs[ROOT_INDEX] = nullptr;
+    }
+
+    // builds a balanced tree straight from [first, last), see build_from_sorted()
+    template<typename InputIt>
+    MySearchTree(InputIt first, InputIt last, const Compare& comparator = Compare(),
+                 const Allocator& allocator = Allocator())
+        : CompareHolder<T, Compare>(comparator), m_slots(allocator), m_alpha(0), m_minOccupancy(0)
+    {
+        build_from_sorted(first, last);
     }
 
     // NOTE: This only works with integers because of the charWidth calculation
@@ -75,7 +182,7 @@ public:
     void prettyPrint(std::stringstream& os)
     {
         // print nothing if tree is empty
-        if (!exists(m_nodePtrs[ROOT_INDEX]))
+        if (!exists(ROOT_INDEX))
         {
             return;
         }
@@ -93,7 +200,7 @@ public:
         std::string midLine;
         std::string loLine;
         int charWidth = 0;
-        int largestVal = m_nodePtrs[largest(ROOT_INDEX)]->getVal();
+        int largestVal = valAt(largest(ROOT_INDEX));
         while (largestVal > 0)
         {
             largestVal = largestVal / 10;
@@ -108,7 +215,7 @@ public:
                 preCharSpace = nodeRank(ROOT_INDEX);
                 preCharSpace = preCharSpace * charWidth;
                 addSpaces(valLine, preCharSpace);
-                std::string currentVal = std::to_string(m_nodePtrs[ROOT_INDEX]->getVal());
+                std::string currentVal = std::to_string(valAt(ROOT_INDEX));
                 valLine += currentVal;
                 os << valLine << std::endl;
             }
@@ -192,120 +299,145 @@ public:
 
     int balance()
     {
-        getSortedVals(1);
-    	// reset tree to empty vector of size 2
-    	m_nodePtrs.clear();
-    	m_nodePtrs.push_back(std::shared_ptr<Node>());
-    	m_nodePtrs.push_back(std::shared_ptr<Node>());
+        typename Stats::BalanceTimer timer(*this);
+        if (!exists(ROOT_INDEX))
+        {
+            return 0;
+        }
+
+        // move the keys out in order before the slots are wiped. This buffer is the only extra storage
+        // and it is freed on return
+        std::vector<Node> vals;
+        reserveNodes(vals, ROOT_INDEX);
+        forEachSlot(ROOT_INDEX, [&](std::size_t slot)
+        {
+            vals.push_back(std::move(m_slots.value(slot)));
+        });
+        m_slots.releaseStorage();
 
-    	medianBalance(m_sortedVals, 0, m_sortedVals.size());
+    	buildFromSorted(std::make_move_iterator(vals.begin()), std::make_move_iterator(vals.end()),
+    	                std::random_access_iterator_tag());
 
         return getNumBarren(1);
     }
 
-	bool insert(const T& value)
+    // Same result as balance(), with the work split across the pool's threads. Subtree sizes give every
+    // node's in-order position directly, so the left and right subtrees are moved out into the sorted
+    // buffer independently. The median recursion writes disjoint slots, so its two halves are placed
+    // independently too. Small subtrees are handled inline. In multiset mode the sizes count repeats
+    // rather than nodes, so they are first overwritten with node counts by a parallel pass of their own;
+    // the slots are cleared afterwards anyway, and the counts travel with the nodes
+    int balance(WorkStealingPool& pool)
     {
-    	int pos = findIndex(value);
-
-    	// if the spot is empty, we can insert it
-        if (!static_cast<bool>(m_nodePtrs[pos]))
+        typename Stats::BalanceTimer timer(*this);
+        if (!exists(ROOT_INDEX))
         {
-        	m_nodePtrs[pos] = std::make_shared<MySearchTree<T>::Node>(value);
-        	// balance();
-        	return true; 
+            return 0;
         }
-        // if the spot is taken, it means this is a duplicate
-        else
+
+        std::size_t numVals = m_slots.numOccupied();
+        std::vector<Node> vals(numVals);
+        if (Keys::MULTISET)
         {
-        	return false;
+            countNodesParallel(pool, ROOT_INDEX);
         }
+        extractParallel(pool, ROOT_INDEX, vals.data());
+
+        m_slots.releaseStorage();
+        m_slots.allocatePages(lastBalancedSlot(numVals));
+        placeParallel(pool, std::make_move_iterator(vals.begin()), 0, numVals, ROOT_INDEX);
+        m_slots.releaseEmptyPages();
+
+        return getNumBarren(1);
+    }
+
+	bool insert(const T& value)
+    {
+    	typename Stats::Timer timer(*this, STAT_INSERT);
+    	std::size_t pos = findIndex(value);
+    	return insertAt(pos, value);
+    }
+
+    // moves the key in instead of copying it
+	bool insert(T&& value)
+    {
+    	typename Stats::Timer timer(*this, STAT_INSERT);
+    	std::size_t pos = findIndex(value);
+    	return insertAt(pos, std::move(value));
+    }
+
+    // Builds the key from args and moves it into its slot. The key has to exist before its slot can be
+    // found, so it is constructed once up front rather than in the slot itself; there is no copy either way
+    template<typename... Args>
+    bool emplace(Args&&... args)
+    {
+    	typename Stats::Timer timer(*this, STAT_INSERT);
+    	T value(std::forward<Args>(args)...);
+    	std::size_t pos = findIndex(value);
+    	return insertAt(pos, std::move(value));
     }
 
 	bool remove(const T& value)
     {
-    	int toRemove = findIndex(value);
+    	typename Stats::Timer timer(*this, STAT_REMOVE);
+    	std::size_t toRemove = findIndex(value);
 
     	// if the spot is empty, we can't remove anything
-        if (!static_cast<bool>(m_nodePtrs[toRemove]))
+        if (!exists(toRemove))
         {
         	return false;
         }
 
-        // if the node has no children, we can safely remove it
-        if (!hasChildren(toRemove))
+        // in multiset mode, a key that is there more than once just loses one
+        if (countAt(toRemove) > 1)
         {
-        	m_nodePtrs[toRemove].reset();
-        	return true; 
+            changeCount(toRemove, -1);
+            logChange(LOG_REMOVE, &value, countAt(toRemove));
+            return true;
         }
 
-        else
-        {
-        	if (hasR(toRemove))
-        	{
-        		// if R doesn't have a left child, we need to manually swap it. Otherwise
-        		// smallest() will find the smallest of R rather than toRemove
-        		if (!hasL(toRemove * 2 + 1))
-        		{
-        			int toSwap = toRemove * 2 + 1;
-	        		swap(m_nodePtrs, toRemove, toSwap); 
-	        		toRemove = toSwap;        			
-        		}
-        		else
-        		{
-	        		int toSwap = smallest(toRemove * 2 + 1);
-	        		swap(m_nodePtrs, toRemove, toSwap); 
-	        		toRemove = toSwap;        			
-        		}
-
-        		while(hasChildren(toRemove))
-        		{
-        			int toSwap = smallest(toRemove);
-        			swap(m_nodePtrs, toRemove, toSwap);
-	        		toRemove = toSwap;
-        		}
+        // at this point the key has been swapped down to a node with no children, so we can delete it
+        clearSlot(sinkToLeaf(toRemove));
+        logChange(LOG_REMOVE, &value, 0);
+        compactIfSparse();
+        return true;
+    }
 
-        		// at this point the node has no children, so we can delete it
-        		m_nodePtrs[toRemove].reset();
-        		return true;
-        	}
-        	else if (hasL(toRemove))
-        	{
-        		if (!hasR(toRemove * 2))
-        		{
-        			int toSwap = toRemove * 2;
-	        		swap(m_nodePtrs, toRemove, toSwap); 
-	        		toRemove = toSwap;        			
-        		}
-        		else
-        		{
-	        		int toSwap = largest(toRemove * 2);
-	        		swap(m_nodePtrs, toRemove, toSwap); 
-	        		toRemove = toSwap;        			
-        		}
+    // Removes the key equal to value and moves it into out. Returns false, leaving out alone, if there
+    // is no such key. In multiset mode this removes one occurrence, and while others are left the key
+    // is copied out instead
+    bool extract(const T& value, T& out)
+    {
+    	typename Stats::Timer timer(*this, STAT_REMOVE);
+    	std::size_t toRemove = findIndex(value);
+        if (!exists(toRemove))
+        {
+        	return false;
+        }
 
-        		while(hasChildren(toRemove))
-        		{
-        			int toSwap = largest(toRemove);
-        			swap(m_nodePtrs, toRemove, toSwap);
-	        		toRemove = toSwap;
-        		}
+        if (countAt(toRemove) > 1)
+        {
+            copyKey(toRemove, out, std::integral_constant<bool, Keys::MULTISET>());
+            changeCount(toRemove, -1);
+            logChange(LOG_REMOVE, &value, countAt(toRemove));
+            return true;
+        }
 
-        		// at this point the node has no children, so we can delete it
-        		m_nodePtrs[toRemove].reset();
-        		return true;        		
-        	}
-        }  
-        return false;   	
+        toRemove = sinkToLeaf(toRemove);
+        out = std::move(m_slots.value(toRemove).m_data);
+        clearSlot(toRemove);
+        logChange(LOG_REMOVE, &value, 0);
+        compactIfSparse();
+        return true;
     }
 
-
-
-	bool contains(const T& value)
+	bool contains(const T& value) const
     {
-    	int pos = findIndex(value);
+    	typename Stats::Timer timer(*this, STAT_LOOKUP);
+    	std::size_t pos = findIndex(value);
 
     	// if the spot is empty, our tree doesn't contain the value
-        if (!static_cast<bool>(m_nodePtrs[pos]))
+        if (!exists(pos))
         {
         	return false;
         }
@@ -316,200 +448,701 @@ public:
         }        	
     }
 
-	MySearchTree::Node* getRoot()
+    // Number of times value is in the tree, 0 if it isn't. Only a multiset can hold a key more than
+    // once; the count is read from the node the descent stopped on
+    int count(const T& value) const
     {
-        return m_nodePtrs[1].get();
+    	typename Stats::Timer timer(*this, STAT_LOOKUP);
+        const Node* node = m_slots.get(findIndex(value));
+        return (node == nullptr) ? 0 : node->count();
     }
 
-    int rank(const T& value)
+    // removes every key and hands all of the page storage back, including anything the allocator
+    // was keeping for reuse that no other tree sharing it is still using
+    void clear()
     {
-        if (!contains(value))
-        {
-            return 0;
-        }
-
-        int pos = findIndex(value);
-        return nodeRank(pos);
+        m_slots.releaseStorage();
+        logChange(LOG_CLEAR, nullptr, 0);
     }
 
-    int size(const T& value)
+    // Replaces the contents with the keys in [first, last), which must be strictly ascending according
+    // to the comparator. Each key's slot is computed from its position in the range, so this runs in
+    // O(n) with no comparisons. The resulting shape is the same one balance() produces. In multiset
+    // mode the keys only have to be ascending, and each run of equal keys becomes one counted node
+    template<typename InputIt>
+    void build_from_sorted(InputIt first, InputIt last)
     {
-        if (!contains(value))
+        if (Keys::MULTISET)
         {
-            return 0;
+            std::vector<Node> nodes;
+            for (; first != last; ++first)
+            {
+                if (!nodes.empty() && compare(nodes.back().getVal(), *first) == 0)
+                {
+                    nodes.back().setCount(nodes.back().count() + 1);
+                }
+                else
+                {
+                    nodes.emplace_back();
+                    nodes.back().m_data = *first;
+                }
+            }
+            buildFromSorted(std::make_move_iterator(nodes.begin()), std::make_move_iterator(nodes.end()),
+                            std::random_access_iterator_tag());
         }
-
-        int pos = findIndex(value);
-        return nodeSize(pos);
+        else
+        {
+            buildFromSorted(first, last, typename std::iterator_traits<InputIt>::iterator_category());
+        }
+        logContents();
     }
 
-private:
-	std::vector<std::shared_ptr<Node> > m_nodePtrs;
-	std::function<int(T,T)> compare;
-	std::vector<ValStruct> m_sortedVals;
-
-    bool isRightChild(int index)
+    // Opt-in scapegoat style self balancing. Whenever an insert lands deeper than log base 1/alpha
+    // of the node count, the lowest ancestor whose heavier child holds more than alpha of its subtree
+    // is rebuilt in place within its own index range, so only the offending subtree is touched.
+    // alpha must be between 0.5 and 1 (exclusive); lower values keep the tree shallower at the cost of
+    // more frequent rebuilds. Pass 0 to turn it off again, which is the default.
+    void setAutoBalance(double alpha)
     {
-        if (index == ROOT_INDEX)
-        {
-            return false;
-        }
-        if (index == ((index / 2) * 2 + 1))
+        if (alpha != 0 && (alpha <= 0.5 || alpha >= 1))
         {
-            return true;
+            throw std::invalid_argument( "Auto balance alpha must be 0 (off) or between 0.5 and 1" );
         }
-        return false; 
+        m_alpha = alpha;
     }
 
-    bool areSiblings(int lhs, int rhs)
+    // A remove only gives a page back once its last slot is empty, so after a mass delete the keys
+    // that are left can be spread thinly over many pages. This rebuilds them into the fewest pages
+    // that hold them (the shape balance() produces) and trims the page tables to match. Like clear(),
+    // the rebuild hands a SlabAllocator's slabs back before placing the keys again
+    void shrink_to_fit()
     {
-        if ((lhs/2) * 2 + 1 == rhs)
+        if (exists(ROOT_INDEX))
         {
-            return true;
+            balance();
         }
-        if ((lhs/2) * 2 == rhs)
+        else
         {
-            return true;
+            m_slots.releaseStorage();
         }
-        return false;
+        m_slots.shrinkToFit();
     }
 
-    void addSpaces(std::string& line, int spaces)
+    // Opt-in automatic shrink_to_fit(). Whenever a remove leaves fewer than minOccupancy of the slots
+    // on allocated pages filled, and a rebuild would need fewer pages, the tree is compacted. Each
+    // rebuild is O(n) but leaves at least about half of the slots filled, so with minOccupancy at most
+    // 0.5 it takes a proportional number of removes to trigger the next one. Pass 0 to turn it off
+    // again, which is the default
+    void setAutoCompact(double minOccupancy)
     {
-        for (int ii = 0; ii < spaces; ++ii)
+        if (minOccupancy < 0 || minOccupancy > 0.5)
         {
-            line += " ";
+            throw std::invalid_argument( "Auto compact occupancy must be 0 (off) or up to 0.5" );
         }
+        m_minOccupancy = minOccupancy;
     }
 
-    void addSpaces(std::string& line1, std::string& line2, std::string& line3, int spaces)
+    // slots and bytes taken by the slot pages and their tables right now
+    MemoryUsage memory_usage() const
     {
-        for (int ii = 0; ii < spaces; ++ii)
-        {
-            line1 += " ";
-            line2 += " ";
-            line3 += " ";
-        }
+        return m_slots.memoryUsage();
     }
 
-    // this assumes index != root 
-    // branch space is from the parent twig to the child twig, inclusive
-    void addBranchSpaceLeft(int index, int charWidth, std::string& midLine, std::string& loLine, std::string& valLine)
-    {
-        int parent = index / 2;
-        // add 1 here because we want to include the parent column
-        int branchSpace = 1 + nodeRank(parent) - nodeRank(index); 
-        branchSpace = branchSpace * charWidth;
+    // Batched lookups. The descents for up to BATCH_WIDTH keys advance one level per round in lock
+    // step, and each one prefetches the slot it will visit next, so the cache misses of the whole
+    // group overlap instead of stalling one key at a time. Results line up with keys[0, count)
 
-        addUnderscores(midLine, branchSpace - charWidth);
-        midLine += "|";
-        if (exists(m_nodePtrs[index + 1])) // check whether this is a sibling
+    // out[i] is whether keys[i] is in the tree
+    void contains_batch(const T* keys, std::size_t count, bool* out) const
+    {
+        descendBatch(keys, count, false, [&](std::size_t ii, std::size_t slot, int)
         {
-            addUnderscores(midLine, charWidth - 1); // subtract 1 because we added a "|" already
-        }
-        else
+            out[ii] = m_slots.occupied(slot);
+        });
+    }
+
+    // out[i] points at the stored key equal to keys[i], or is nullptr if there isn't one
+    void find_batch(const T* keys, std::size_t count, const T** out) const
+    {
+        descendBatch(keys, count, false, [&](std::size_t ii, std::size_t slot, int)
         {
-            addSpaces(midLine, charWidth - 1); // subtract 1 because we added a "|" already
-        }
+            const Node* node = m_slots.get(slot);
+            out[ii] = (node == nullptr) ? nullptr : &node->getVal();
+        });
+    }
 
-        loLine += "|";
-        addSpaces(loLine, branchSpace - 1); // subtract 1 to make space for the "|"
+    // out[i] is rank(keys[i])
+    void rank_batch(const T* keys, std::size_t count, int* out) const
+    {
+        descendBatch(keys, count, true, [&](std::size_t ii, std::size_t slot, int rankSum)
+        {
+            out[ii] = m_slots.occupied(slot) ? rankSum + m_slots.subtreeSize(slot * 2) : 0;
+        });
+    }
 
-        std::string currentVal = std::to_string(m_nodePtrs[index]->getVal());
-        valLine += currentVal;
-        addSpaces(valLine, branchSpace - currentVal.size());
+    // Returns a read-only, densely packed copy of the current contents for read-mostly workloads.
+    // Later changes to this tree are not reflected in the snapshot.
+    FrozenSearchTree<T, Compare> freeze() const
+    {
+        static_assert(!Keys::MULTISET, "A frozen snapshot has no counts, freeze() needs set semantics");
+        std::vector<T> vals;
+        vals.reserve(nodeSize(ROOT_INDEX));
+        vals.assign(begin(), end());
+        return FrozenSearchTree<T, Compare>(vals, this->comparator());
     }
 
-    // this assumes index != root 
-    // branch space is from the parent twig to the child twig, inclusive
-    void addBranchSpaceRight(int index, int charWidth, std::string& midLine, std::string& loLine, std::string& valLine)
+    // Writes the slot array to path as an image that open_mapped() can query without loading it (see
+    // mappedtree.h for the format). The image is written next to path and renamed over it at the end,
+    // so a crash never leaves a half written file behind. Throws std::runtime_error on I/O errors
+    void save(const std::string& path) const
     {
-        int parent = index / 2;
-        int branchSpace = 1 + nodeRank(index) - nodeRank(parent);  
-        branchSpace = branchSpace * charWidth;
-        std::string currentVal = std::to_string(m_nodePtrs[index]->getVal());    
-        int missingSpace = charWidth - currentVal.size();    
+        static_assert(std::is_trivially_copyable<T>::value, "save() writes keys as raw bytes, T must be trivially copyable");
+        static_assert(!Keys::MULTISET, "A mapped image has no counts, save() needs set semantics");
+        static_assert(PagedSlots<Node, Allocator>::PAGE_BITS == MAPPED_PAGE_BITS, "Slot pages must match the image pages");
 
-        if (exists(m_nodePtrs[index - 1])) // check if previous is its sibling
-            // if the sibling exists, it is guaranteed to be the previous value in the print order because
-            // the print function prints from left to right in the tree 
+        std::vector<std::uint64_t> directory;
+        m_slots.forEachPage([&](std::size_t pageNum, const Node*, const int*, const std::uint64_t*)
         {
-            // No midLine "|" necessary because the left sibling should have printed it already
-            // Subtracting charWidth because the parent column is accounted for already
-            addUnderscores(midLine, branchSpace - charWidth - charWidth + 1);
-            addSpaces(midLine, charWidth - 1);
-
-            addSpaces(loLine, branchSpace - charWidth - charWidth);
-            loLine += "|";
-            addSpaces(loLine, charWidth - 1);
+            directory.push_back(pageNum);
+        });
 
-            addSpaces(valLine, branchSpace - charWidth - charWidth);
-            valLine += currentVal;
-            addSpaces(valLine, missingSpace);
+        // the dense index covers the page numbers the live tree keeps in its directly indexed table
+        std::vector<std::uint32_t> dense;
+        for (std::size_t position = 0; position < directory.size(); ++position)
+        {
+            if (directory[position] >= PagedSlots<Node, Allocator>::DENSE_PAGES)
+            {
+                break;
+            }
+            dense.resize(directory[position] + 1, MAPPED_NO_PAGE);
+            dense[directory[position]] = static_cast<std::uint32_t>(position);
         }
 
-        else
+        MappedHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.m_magic, MAPPED_MAGIC, sizeof(MAPPED_MAGIC));
+        header.m_version = MAPPED_VERSION;
+        header.m_endianCheck = MAPPED_ENDIAN_CHECK;
+        header.m_keySize = sizeof(T);
+        header.m_keyAlign = alignof(T);
+        header.m_pageBits = MAPPED_PAGE_BITS;
+        header.m_numKeys = nodeSize(ROOT_INDEX);
+        header.m_numPages = directory.size();
+        header.m_numDense = dense.size();
+        header.m_directoryOffset = sizeof(MappedHeader);
+        header.m_denseOffset = header.m_directoryOffset + directory.size() * sizeof(std::uint64_t);
+        std::uint64_t indexEnd = header.m_denseOffset + dense.size() * sizeof(std::uint32_t);
+        header.m_pagesOffset = (indexEnd + MAPPED_ALIGNMENT - 1) / MAPPED_ALIGNMENT * MAPPED_ALIGNMENT;
+
+        // the image is synced before the rename and the directory after it, the same as a checkpoint
+        // manifest, so the rename can't reach the disk ahead of the data it points to
+        std::string tempPath = path + ".tmp";
+        const char* error = "Failed to write tree image";
+        int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
         {
-            midLine += "|";
-            addUnderscores(midLine, branchSpace - charWidth);
-            addSpaces(midLine, charWidth - 1);
-
-            addSpaces(loLine, branchSpace - charWidth);
-            loLine += "|";
-            addSpaces(loLine, charWidth - 1);            
+            throw std::runtime_error( "Cannot create " + tempPath );
+        }
+        try
+        {
+            writeAllAt(fd, &header, sizeof(header), 0, error);
+            writeAllAt(fd, directory.data(), directory.size() * sizeof(std::uint64_t), header.m_directoryOffset, error);
+            writeAllAt(fd, dense.data(), dense.size() * sizeof(std::uint32_t), header.m_denseOffset, error);
+            std::vector<char> padding(header.m_pagesOffset - indexEnd, 0);
+            writeAllAt(fd, padding.data(), padding.size(), indexEnd, error);
+
+            std::unique_ptr<MappedPage<T> > image(new MappedPage<T>());
+            std::uint64_t offset = header.m_pagesOffset;
+            m_slots.forEachPage([&](std::size_t, const Node* values, const int* sizes, const std::uint64_t* occupied)
+            {
+                fillImage(*image, values, sizes, occupied);
+                writeAllAt(fd, image.get(), sizeof(MappedPage<T>), offset, error);
+                offset += sizeof(MappedPage<T>);
+            });
+            if (::fsync(fd) != 0)
+            {
+                throw std::runtime_error( "Failed to sync tree image " + path );
+            }
+        }
+        catch (...)
+        {
+            ::close(fd);
+            std::remove(tempPath.c_str());
+            throw;
+        }
+        ::close(fd);
 
-            std::string currentVal = std::to_string(m_nodePtrs[index]->getVal());    
-            int missingSpace = charWidth - currentVal.size();    
-            addSpaces(valLine, branchSpace - charWidth);
-            valLine += currentVal;
-            addSpaces(valLine, missingSpace);
+        if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+        {
+            std::remove(tempPath.c_str());
+            throw std::runtime_error( "Failed to write tree image " + path );
         }
+        std::size_t slash = path.find_last_of('/');
+        syncDirectory((slash == std::string::npos) ? "." : (slash == 0) ? "/" : path.substr(0, slash));
     }
 
-    void addUnderscores(std::string& line, int underscores)
+    // Snapshot of the instrumentation counters (see stats.h). Without a counting policy only the page
+    // allocation counts are filled in
+    TreeStats stats() const
     {
-        for (int ii = 0; ii < underscores; ++ii)
-        {
-            line += "_";
-        }
+        TreeStats snapshot = Stats::snapshot();
+        snapshot.m_pageAllocations = m_slots.numAllocations();
+        snapshot.m_bytesAllocated = m_slots.numAllocations() * PagedSlots<Node, Allocator>::pageBytes();
+        return snapshot;
     }
 
-    int getHeight(int index)
+    // Maps an image written by save(). Lookups read straight from the file, see mappedtree.h
+    static MappedSearchTree<T, Compare> open_mapped(const std::string& path, const Compare& comparator = Compare())
+    {
+        return MappedSearchTree<T, Compare>(path, comparator);
+    }
+
+    // Checkpoints the slot array into the directory dir (see checkpoint.h for the format). The first
+    // checkpoint into a directory writes every page; after that only the pages changed since the
+    // previous checkpoint are appended. Throws std::runtime_error on I/O errors, in which case the
+    // last committed checkpoint is left as it was and the next one writes every page again
+    void checkpoint(const std::string& dir)
     {
-        if (!exists(m_nodePtrs[index]))
+        static_assert(std::is_trivially_copyable<T>::value, "checkpoint() writes keys as raw bytes, T must be trivially copyable");
+        static_assert(PagedSlots<Node, Allocator>::PAGE_BITS == MAPPED_PAGE_BITS, "Slot pages must match the image pages");
+
+        try
         {
-            return 0;
+            bool full = m_checkpoint.begin(dir);
+            std::unique_ptr<MappedPage<T> > image(new MappedPage<T>());
+            auto write = [&](std::size_t pageNum, const Node* values, const int* sizes, const std::uint64_t* occupied)
+            {
+                fillImage(*image, values, sizes, occupied);
+                m_checkpoint.writePage(pageNum, *image);
+            };
+            if (full)
+            {
+                m_slots.forEachPage(write);
+                m_slots.markClean();
+            }
+            else
+            {
+                m_slots.takeDirtyPages(write);
+            }
+
+            std::vector<std::size_t> livePages;
+            m_slots.forEachPage([&](std::size_t pageNum, const Node*, const int*, const std::uint64_t*)
+            {
+                livePages.push_back(pageNum);
+            });
+            m_checkpoint.commit(livePages, nodeSize(ROOT_INDEX));
+        }
+        catch (...)
+        {
+            m_checkpoint.reset();
+            throw;
         }
 
-        if (!withinCapacity(index * 2 + 1))
+        // everything logged so far is in the checkpoint now
+        if (m_log.isOpen())
         {
-            incCapacity();
+            m_log.truncate();
         }
+    }
 
-        int sizeL = getHeight(index * 2);
-        int sizeR = getHeight(index * 2 + 1);
+    // Replaces the contents with the last checkpoint committed to dir. Later checkpoints into dir carry
+    // on incrementally from it. Throws std::runtime_error if the checkpoint is missing or corrupt, and
+    // leaves the tree empty in that case
+    void restore(const std::string& dir)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "restore() reads keys as raw bytes, T must be trivially copyable");
 
-        if (index == 1)
+        m_slots.clear();
+        try
         {
-            // height starts at 0 for the first line 
-            --sizeL;
-            --sizeR;
+            m_checkpoint.read(dir, [&](std::size_t pageNum, const MappedPage<T>& image)
+            {
+                Node* values = m_slots.loadPage(pageNum, image.m_sizes, image.m_occupied);
+                for (std::size_t offset = 0; offset < MAPPED_PAGE_SIZE; ++offset)
+                {
+                    if ((image.m_occupied[offset / 64] >> (offset % 64)) & 1)
+                    {
+                        values[offset].m_data = image.m_keys[offset];
+                    }
+                }
+            });
         }
-
-        if ( sizeL > sizeR )
+        catch (...)
         {
-            return 1 + sizeL;
+            m_slots.clear();
+            throw;
         }
-        else
+        if (Keys::MULTISET)
         {
-            return 1 + sizeR;
+            recountKeys();
         }
+        logContents();
     }
 
-    int nodeRank(int index)
+    // Opens the write-ahead log at path (see wal.h), creating it if needed. Every record already in it
+    // is replayed onto the current contents first, so after a crash, restore() the last checkpoint and
+    // then open its log again. From then on each insert, remove and clear that changes the tree is
+    // appended to the log. Returns the number of records replayed. Throws std::runtime_error if the log
+    // can't be opened or was written for another key type
+    std::size_t open_log(const std::string& path)
+    {
+        return m_log.open(path, [this](LogOp op, const LogKey& record)
+        {
+            if (op == LOG_CLEAR)
+            {
+                clear();
+            }
+            else if (Keys::MULTISET)
+            {
+                // the record holds the key's count after the change
+                setCount(Keys::logKeyOf(record), Keys::logCountOf(record));
+            }
+            else if (op == LOG_INSERT)
+            {
+                insert(Keys::logKeyOf(record));
+            }
+            else
+            {
+                remove(Keys::logKeyOf(record));
+            }
+        });
+    }
+
+    // Returns once every change logged so far is on disk. Concurrent callers share fsyncs, see
+    // ConcurrentSearchTree for the usual way to get that
+    void sync_log()
+    {
+        sync_log(log_position());
+    }
+
+    // Returns once every change up to position (from log_position()) is on disk. This only touches the
+    // log, so it may run while another thread changes the tree or opens and closes the log. A position
+    // taken before close_log() is already synced, so it returns right away
+    void sync_log(std::uint64_t position)
+    {
+        m_log.sync(position);
+    }
+
+    // position of the last logged change, 0 without a log
+    std::uint64_t log_position() const
+    {
+        return m_log.isOpen() ? m_log.position() : 0;
+    }
+
+    // syncs and detaches the log
+    void close_log()
+    {
+        m_log.close();
+    }
+
+	MySearchTree::Node* getRoot()
+    {
+        if (!exists(ROOT_INDEX))
+        {
+            return nullptr;
+        }
+        return &m_slots.value(ROOT_INDEX);
+    }
+
+	const MySearchTree::Node* getRoot() const
+    {
+        return m_slots.get(ROOT_INDEX);
+    }
+
+    // number of values in the tree smaller than value, or 0 if value isn't in the tree
+    int rank(const T& value) const
+    {
+        typename Stats::Timer timer(*this, STAT_LOOKUP);
+        std::size_t current = ROOT_INDEX;
+        int rankSum = 0;
+
+        while (exists(current))
+        {
+            int result = compare(value, valAt(current));
+            if (result == 0)
+            {
+                return rankSum + nodeSize(current * 2);
+            }
+            else if (result > 0)
+            {
+                rankSum += nodeSize(current * 2) + countAt(current); // include the parent in the rank
+                current = current * 2 + 1;
+            }
+            else
+            {
+                current = current * 2;
+            }
+        }
+        return 0;
+    }
+
+    // number of values in the subtree rooted at value, or 0 if value isn't in the tree
+    int size(const T& value) const
+    {
+        typename Stats::Timer timer(*this, STAT_LOOKUP);
+        std::size_t pos = findIndex(value);
+        return nodeSize(pos);
+    }
+
+    // the key with exactly k smaller keys in the tree, ie. select(rank(x)) is x. Uses the subtree sizes
+    // to pick a side at every level, so no keys are compared. In multiset mode a key that is there c
+    // times is selected by the c positions from its rank on
+    const T& select(int k) const
+    {
+        if (k < 0 || k >= nodeSize(ROOT_INDEX))
+        {
+            throw std::out_of_range( "select() index is outside the tree" );
+        }
+
+        std::size_t current = ROOT_INDEX;
+        while (true)
+        {
+            int leftSize = nodeSize(current * 2);
+            int parentCount = countAt(current);
+            if (k >= leftSize && k < leftSize + parentCount)
+            {
+                return valAt(current);
+            }
+            else if (k > leftSize)
+            {
+                k -= leftSize + parentCount; // skip the left subtree and the parent
+                current = current * 2 + 1;
+            }
+            else
+            {
+                current = current * 2;
+            }
+        }
+    }
+
+    // number of keys in [lo, hi], which don't have to be in the tree themselves
+    int count_between(const T& lo, const T& hi) const
+    {
+        if (compare(lo, hi) > 0)
+        {
+            return 0;
+        }
+        return countBelow(hi, true) - countBelow(lo, false);
+    }
+
+    const_iterator begin() const
+    {
+        if (!exists(ROOT_INDEX))
+        {
+            return end();
+        }
+        return const_iterator(this, leftmost(ROOT_INDEX));
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, END_SLOT);
+    }
+
+    // first key that is not less than value
+    const_iterator lower_bound(const T& value) const
+    {
+        return boundSearch(value, true);
+    }
+
+    // first key that is greater than value
+    const_iterator upper_bound(const T& value) const
+    {
+        return boundSearch(value, false);
+    }
+
+    std::pair<const_iterator, const_iterator> equal_range(const T& value) const
+    {
+        return std::make_pair(lower_bound(value), upper_bound(value));
+    }
+
+private:
+	// how many descents a batched lookup keeps in flight at once
+	static const std::size_t BATCH_WIDTH = 16;
+
+	// subtrees smaller than this aren't worth handing to another thread in balance(pool)
+	static const std::size_t PARALLEL_CUTOFF = 1 << 14;
+
+	// what iterators point at once they're past the largest key. Index 0 is never a slot
+	static const std::size_t END_SLOT = 0;
+
+	// the deepest slot that can be filled. Children of any filled slot can then always be addressed
+	// without overflowing an index, so descents never need to check for it
+	static const std::size_t MAX_SLOT_INDEX = SIZE_MAX / 2;
+
+	// what each write-ahead log record holds besides the operation (see multiplicity.h)
+	typedef typename Keys::template LogKey<T> LogKey;
+
+	// every comparison in the tree goes through here, so the stats policy sees them all
+	int compare(const T& lhs, const T& rhs) const
+	{
+		Stats::onCompare();
+		return CompareHolder<T, Compare>::compare(lhs, rhs);
+	}
+
+	PagedSlots<Node, Allocator> m_slots;
+	double m_alpha; // 0 when auto balancing is off
+	double m_minOccupancy; // 0 when auto compaction is off
+	CheckpointLog<T> m_checkpoint; // what the last checkpoint() wrote, so the next one can skip clean pages
+	WriteAheadLog<LogKey> m_log; // only open after open_log()
+
+    bool isRightChild(int index)
+    {
+        if (index == ROOT_INDEX)
+        {
+            return false;
+        }
+        if (index == ((index / 2) * 2 + 1))
+        {
+            return true;
+        }
+        return false; 
+    }
+
+    bool areSiblings(int lhs, int rhs)
+    {
+        if ((lhs/2) * 2 + 1 == rhs)
+        {
+            return true;
+        }
+        if ((lhs/2) * 2 == rhs)
+        {
+            return true;
+        }
+        return false;
+    }
+
+    void addSpaces(std::string& line, int spaces)
+    {
+        for (int ii = 0; ii < spaces; ++ii)
+        {
+            line += " ";
+        }
+    }
+
+    void addSpaces(std::string& line1, std::string& line2, std::string& line3, int spaces)
+    {
+        for (int ii = 0; ii < spaces; ++ii)
+        {
+            line1 += " ";
+            line2 += " ";
+            line3 += " ";
+        }
+    }
+
+    // this assumes index != root 
+    // branch space is from the parent twig to the child twig, inclusive
+    void addBranchSpaceLeft(int index, int charWidth, std::string& midLine, std::string& loLine, std::string& valLine)
+    {
+        int parent = index / 2;
+        // add 1 here because we want to include the parent column
+        int branchSpace = 1 + nodeRank(parent) - nodeRank(index); 
+        branchSpace = branchSpace * charWidth;
+
+        addUnderscores(midLine, branchSpace - charWidth);
+        midLine += "|";
+        if (exists(index + 1)) // check whether this is a sibling
+        {
+            addUnderscores(midLine, charWidth - 1); // subtract 1 because we added a "|" already
+        }
+        else
+        {
+            addSpaces(midLine, charWidth - 1); // subtract 1 because we added a "|" already
+        }
+
+        loLine += "|";
+        addSpaces(loLine, branchSpace - 1); // subtract 1 to make space for the "|"
+
+        std::string currentVal = std::to_string(valAt(index));
+        valLine += currentVal;
+        addSpaces(valLine, branchSpace - currentVal.size());
+    }
+
+    // this assumes index != root 
+    // branch space is from the parent twig to the child twig, inclusive
+    void addBranchSpaceRight(int index, int charWidth, std::string& midLine, std::string& loLine, std::string& valLine)
+    {
+        int parent = index / 2;
+        int branchSpace = 1 + nodeRank(index) - nodeRank(parent);  
+        branchSpace = branchSpace * charWidth;
+        std::string currentVal = std::to_string(valAt(index));    
+        int missingSpace = charWidth - currentVal.size();    
+
+        if (exists(index - 1)) // check if previous is its sibling
+            // if the sibling exists, it is guaranteed to be the previous value in the print order because
+            // the print function prints from left to right in the tree 
+        {
+            // No midLine "|" necessary because the left sibling should have printed it already
+            // Subtracting charWidth because the parent column is accounted for already
+            addUnderscores(midLine, branchSpace - charWidth - charWidth + 1);
+            addSpaces(midLine, charWidth - 1);
+
+            addSpaces(loLine, branchSpace - charWidth - charWidth);
+            loLine += "|";
+            addSpaces(loLine, charWidth - 1);
+
+            addSpaces(valLine, branchSpace - charWidth - charWidth);
+            valLine += currentVal;
+            addSpaces(valLine, missingSpace);
+        }
+
+        else
+        {
+            midLine += "|";
+            addUnderscores(midLine, branchSpace - charWidth);
+            addSpaces(midLine, charWidth - 1);
+
+            addSpaces(loLine, branchSpace - charWidth);
+            loLine += "|";
+            addSpaces(loLine, charWidth - 1);            
+
+            std::string currentVal = std::to_string(valAt(index));    
+            int missingSpace = charWidth - currentVal.size();    
+            addSpaces(valLine, branchSpace - charWidth);
+            valLine += currentVal;
+            addSpaces(valLine, missingSpace);
+        }
+    }
+
+    void addUnderscores(std::string& line, int underscores)
+    {
+        for (int ii = 0; ii < underscores; ++ii)
+        {
+            line += "_";
+        }
+    }
+
+    int getHeight(int index)
+    {
+        if (!exists(index))
+        {
+            return 0;
+        }
+
+        int sizeL = getHeight(index * 2);
+        int sizeR = getHeight(index * 2 + 1);
+
+        if (index == 1)
+        {
+            // height starts at 0 for the first line 
+            --sizeL;
+            --sizeR;
+        }
+
+        if ( sizeL > sizeR )
+        {
+            return 1 + sizeL;
+        }
+        else
+        {
+            return 1 + sizeR;
+        }
+    }
+
+    int nodeRank(int index) const
     {
         // verify the node is not null 
-        if (!exists(m_nodePtrs[index]))
+        if (!exists(index))
         {
             return 0;
         }
@@ -519,16 +1152,11 @@ private:
 
         while(true)
         {
-            if (!withinCapacity(current * 2 + 1))
-            {
-                incCapacity();
-            }
-
             if (index == current)
             {
                 return rankSum + nodeSize(current * 2);
             }
-            else if (m_nodePtrs[index]->getVal() > m_nodePtrs[current]->getVal())
+            else if (compare(valAt(index), valAt(current)) > 0)
             {
                 rankSum += nodeSize(current * 2) + 1; // add 1 to include the parent in the rank
                 current = current * 2 + 1; 
@@ -540,293 +1168,641 @@ private:
         }
     }
 
-    int nodeSize(int index)
+    int nodeSize(std::size_t index) const
+    {
+        return m_slots.subtreeSize(index);
+    }
+
+    void getNextRow(std::vector<int>& vec)
+    {
+        std::vector<int> newVec;
+        for (int ii : vec)
+        {
+            if (ii == 0)
+            {
+                continue;
+            }
+            else
+            {
+                if (exists(ii * 2))
+                {
+                    newVec.push_back(ii * 2);
+                }
+                if (exists(ii * 2 + 1))
+                {
+                    newVec.push_back(ii * 2 + 1);
+                }
+            }
+        }
+        std::swap(vec, newVec);
+    }
+
+    bool exists(std::size_t index) const
+    {
+        return m_slots.occupied(index);
+    }
+
+    // the slot must be occupied
+    const T& valAt(std::size_t index) const
+    {
+        return m_slots.value(index).getVal();
+    }
+
+    // Calls visit(slot) for every occupied slot in the subtree rooted at startingIndex, in key order.
+    // It steps from slot to slot with nextSlot(), so it keeps no stack and no list of visited slots.
+    // visit may move the key out of the slot, but must not fill or open slots
+    template<typename Visitor>
+    void forEachSlot(std::size_t startingIndex, Visitor visit) const
+    {
+        int remaining = nodeSize(startingIndex);
+        if (remaining == 0)
+        {
+            return;
+        }
+
+        // in multiset mode the size counts repeats, so each slot takes its count off
+        std::size_t currentInd = leftmost(startingIndex);
+        while (true)
+        {
+            int visited = countAt(currentInd);
+            visit(currentInd);
+            if ((remaining -= visited) == 0)
+            {
+                return;
+            }
+            currentInd = nextSlot(currentInd);
+        }
+    }
+
+    // where barren = no children
+    int getNumBarren(std::size_t startingIndex) const
+    {
+        int numBarren = 0;
+        forEachSlot(startingIndex, [&](std::size_t slot)
+        {
+            if (!hasChildren(slot))
+            {
+                ++numBarren;
+            }
+        });
+        return numBarren;
+    }
+
+    // opens every slot in the subtree rooted at slot, children first. Only the subtree's own sizes are
+    // reset, the caller is responsible for the ancestors
+    void clearSubtree(std::size_t slot)
+    {
+        if (!exists(slot))
+        {
+            return;
+        }
+
+        clearSubtree(slot * 2);
+        clearSubtree(slot * 2 + 1);
+        m_slots.addSubtreeSize(slot, -nodeSize(slot));
+        m_slots.vacate(slot);
+    }
+
+    // Called after filling slot pos. If pos is deeper than the scapegoat bound, walks back up to the
+    // first ancestor that is out of alpha balance and rebuilds that subtree. An ancestor like that
+    // is guaranteed to exist whenever the bound is exceeded
+    void rebalanceAfterInsert(std::size_t pos)
+    {
+        int depth = 0;
+        for (std::size_t ind = pos; ind > ROOT_INDEX; ind /= 2)
+        {
+            ++depth;
+        }
+
+        double maxDepth = std::log(static_cast<double>(nodeSize(ROOT_INDEX))) / std::log(1 / m_alpha);
+        if (depth <= maxDepth)
+        {
+            return;
+        }
+
+        std::size_t child = pos;
+        while (child > ROOT_INDEX)
+        {
+            std::size_t parent = child / 2;
+            if (nodeSize(child) > m_alpha * nodeSize(parent))
+            {
+                rebuildSubtree(parent);
+                return;
+            }
+            child = parent;
+        }
+    }
+
+    // Rebuilds the subtree rooted at subtreeRoot into a balanced shape without leaving its index
+    // range. The node count doesn't change, so the ancestors' subtree sizes stay valid
+    void rebuildSubtree(std::size_t subtreeRoot)
+    {
+        std::vector<Node> vals;
+        reserveNodes(vals, subtreeRoot);
+        forEachSlot(subtreeRoot, [&](std::size_t slot)
+        {
+            vals.push_back(std::move(m_slots.value(slot)));
+        });
+        clearSubtree(subtreeRoot);
+
+        medianBalance(std::make_move_iterator(vals.begin()), 0, vals.size(), subtreeRoot);
+    }
+
+    // Places the sorted range [first + beg, first + end) into the open subtree rooted at slot: the
+    // median goes into slot and each half recurses into one child. Every key's slot follows from its
+    // position in the recursion, so nothing is compared and there is no descent from the root. The
+    // range holds keys or whole nodes (which bring their counts along). Returns the subtree size of
+    // slot, which is simply the length of the subrange unless there are counts to add up
+    template<typename RandomIt>
+    int medianBalance(RandomIt first, std::size_t beg, std::size_t end, std::size_t slot)
+    {
+        if (beg == end)
+        {
+            return 0;
+        }
+
+        std::size_t mid = beg + (end - beg) / 2;
+        Node& node = m_slots.occupy(slot);
+        assignSlot(node, first[mid]);
+        int size = node.count() + medianBalance(first, beg, mid, slot * 2) +
+                   medianBalance(first, mid + 1, end, slot * 2 + 1);
+        m_slots.addSubtreeSize(slot, size);
+        return size;
+    }
+
+    // a key put into a slot by a rebuild is there once; a node keeps its count
+    template<typename U>
+    static void assignSlot(Node& node, U&& value)
+    {
+        node.m_data = std::forward<U>(value);
+        node.setCount(1);
+    }
+
+    static void assignSlot(Node& node, Node&& value)
+    {
+        node = std::move(value);
+    }
+
+    // sizes a buffer for the nodes of the subtree at slot. In multiset mode the subtree size counts
+    // repeats, which can be far more than the nodes, so the buffer just grows
+    void reserveNodes(std::vector<Node>& vals, std::size_t slot) const
+    {
+        if (!Keys::MULTISET)
+        {
+            vals.reserve(nodeSize(slot));
+        }
+    }
+
+    // the number of times the key in an occupied slot is in the tree. Without CountedKeys that is 1
+    // without looking at the slot
+    int countAt(std::size_t slot) const
+    {
+        return Keys::MULTISET ? m_slots.value(slot).count() : 1;
+    }
+
+    // adds delta to the count of the key in an occupied slot, and to the sizes that include it
+    void changeCount(std::size_t slot, int delta)
+    {
+        Node& node = m_slots.value(slot);
+        node.setCount(node.count() + delta);
+        adjustSizes(slot, delta);
+    }
+
+    // extract() of a key that stays in the tree. Only multisets get there
+    void copyKey(std::size_t slot, T& out, std::true_type) const
+    {
+        out = valAt(slot);
+    }
+
+    void copyKey(std::size_t, T&, std::false_type) const
+    {
+    }
+
+    // Makes count the number of times key is in the tree, for replaying the write-ahead log in multiset
+    // mode. Unlike insert and remove, applying the same count twice changes nothing
+    void setCount(const T& key, int count)
+    {
+        std::size_t pos = findIndex(key);
+        if (!exists(pos))
+        {
+            if (count > 0 && insertAt(pos, key))
+            {
+                setCount(key, count); // the insert may have rebuilt the subtree it landed in
+            }
+            return;
+        }
+
+        if (count > 0)
+        {
+            changeCount(pos, count - countAt(pos));
+        }
+        else
+        {
+            changeCount(pos, 1 - countAt(pos));
+            clearSlot(sinkToLeaf(pos));
+        }
+    }
+
+    // Checkpoints only keep the subtree sizes. In multiset mode each key's count is then whatever its
+    // subtree holds beyond its two children. Restoring leaves the pages clean, and so does this
+    void recountKeys()
+    {
+        for (std::size_t slot = exists(ROOT_INDEX) ? leftmost(ROOT_INDEX) : END_SLOT; slot != END_SLOT;
+             slot = nextSlot(slot))
+        {
+            m_slots.value(slot).setCount(nodeSize(slot) - nodeSize(slot * 2) - nodeSize(slot * 2 + 1));
+        }
+        m_slots.markClean();
+    }
+
+    // replaces the contents with a random access range that is already sorted
+    template<typename RandomIt>
+    void buildFromSorted(RandomIt first, RandomIt last, std::random_access_iterator_tag)
+    {
+        m_slots.clear();
+        std::size_t numVals = last - first;
+        if (numVals == 0)
+        {
+            return;
+        }
+
+        m_slots.reserve(lastBalancedSlot(numVals));
+        medianBalance(first, 0, numVals, ROOT_INDEX);
+    }
+
+    // the check behind setAutoCompact(), cheap enough to run after every remove
+    void compactIfSparse()
+    {
+        if (m_minOccupancy == 0)
+        {
+            return;
+        }
+        typedef PagedSlots<Node, Allocator> Slots;
+        std::size_t numVals = m_slots.numOccupied();
+        std::size_t numPages = m_slots.numPages();
+        std::size_t tightPages = (lastBalancedSlot(numVals) >> Slots::PAGE_BITS) + 1;
+        if (numPages > tightPages && numVals < m_minOccupancy * numPages * Slots::PAGE_SIZE)
+        {
+            shrink_to_fit();
+        }
+    }
+
+    // Appends to the write-ahead log, if one is open. count is the key's count after the change, which
+    // only multiset records keep. open_log() only compiles for keys that can be logged, so there is
+    // nothing to do for any others
+    void logChange(LogOp op, const T* value, int count)
+    {
+        logChange(op, value, count, typename std::is_trivially_copyable<T>::type());
+    }
+
+    void logChange(LogOp op, const T* value, int count, std::true_type)
+    {
+        if (!m_log.isOpen())
+        {
+            return;
+        }
+        if (value == nullptr)
+        {
+            m_log.append(op, nullptr);
+        }
+        else
+        {
+            const LogKey& record = Keys::makeLogKey(*value, count);
+            m_log.append(op, &record);
+        }
+    }
+
+    void logChange(LogOp, const T*, int, std::false_type)
+    {
+    }
+
+    // logs the whole contents, for changes that replace them at once
+    void logContents()
+    {
+        if (!m_log.isOpen())
+        {
+            return;
+        }
+        logChange(LOG_CLEAR, nullptr, 0);
+        for (const_iterator it = begin(); it != end(); ++it)
+        {
+            logChange(LOG_INSERT, &*it, countAt(it.m_slot));
+        }
+    }
+
+    // copies one slot page into its on-disk form (see mappedtree.h). Open slots are written as zero bytes
+    static void fillImage(MappedPage<T>& image, const Node* values, const int* sizes, const std::uint64_t* occupied)
+    {
+        std::memset(&image, 0, sizeof(MappedPage<T>));
+        for (std::size_t offset = 0; offset < MAPPED_PAGE_SIZE; ++offset)
+        {
+            if ((occupied[offset / 64] >> (offset % 64)) & 1)
+            {
+                image.m_keys[offset] = values[offset].getVal();
+            }
+        }
+        std::copy(sizes, sizes + MAPPED_PAGE_SIZE, image.m_sizes);
+        std::copy(occupied, occupied + MAPPED_PAGE_SIZE / 64, image.m_occupied);
+    }
+
+    // a median built tree of n nodes fills exactly the levels needed to hold n
+    static std::size_t lastBalancedSlot(std::size_t numVals)
+    {
+        std::size_t lastSlot = 1;
+        while (lastSlot < numVals)
+        {
+            lastSlot = lastSlot * 2 + 1;
+        }
+        return lastSlot;
+    }
+
+    // replaces the subtree sizes under slot with node counts for extractParallel(), and returns the count.
+    // Only for multiset mode, where the sizes add up repeats; the tree is broken until it is rebuilt
+    int countNodesParallel(WorkStealingPool& pool, std::size_t slot)
     {
-        if (!exists(m_nodePtrs[index]))
+        int weight = nodeSize(slot);
+        if (weight == 0)
         {
             return 0;
         }
 
-        if (!withinCapacity(index * 2 + 1))
+        int leftCount = 0;
+        int rightCount = 0;
+        if (static_cast<std::size_t>(weight) < PARALLEL_CUTOFF)
         {
-            incCapacity();
+            leftCount = countNodesParallel(pool, slot * 2);
+            rightCount = countNodesParallel(pool, slot * 2 + 1);
         }
-
-        getSortedVals(index);
-        return m_sortedVals.size();
+        else
+        {
+            pool.invoke([&]() { leftCount = countNodesParallel(pool, slot * 2); },
+                        [&]() { rightCount = countNodesParallel(pool, slot * 2 + 1); });
+        }
+        int count = leftCount + rightCount + 1;
+        m_slots.addSubtreeSize(slot, count - weight);
+        return count;
     }
 
-    void getNextRow(std::vector<int>& vec)
+    // moves the nodes of the subtree rooted at slot into out, in order. Leaves the slots themselves
+    // alone. The subtree sizes have to be node counts, see countNodesParallel()
+    void extractParallel(WorkStealingPool& pool, std::size_t slot, Node* out)
     {
-        std::vector<int> newVec;
-        for (int ii : vec)
+        std::size_t numVals = nodeSize(slot);
+        if (numVals == 0)
         {
-            if (ii == 0)
-            {
-                continue;
-            }
-            else
-            {
-                if (!withinCapacity(ii * 2 + 1))
-                {
-                    incCapacity();
-                }
+            return;
+        }
 
-                if (exists(m_nodePtrs[ii * 2]))
-                {
-                    newVec.push_back(ii * 2);
-                }
-                if (exists(m_nodePtrs[ii * 2 + 1]))
-                {
-                    newVec.push_back(ii * 2 + 1);
-                }
-            }
+        std::size_t leftSize = nodeSize(slot * 2);
+        out[leftSize] = std::move(m_slots.value(slot));
+        if (numVals < PARALLEL_CUTOFF)
+        {
+            extractParallel(pool, slot * 2, out);
+            extractParallel(pool, slot * 2 + 1, out + leftSize + 1);
+            return;
         }
-        std::swap(vec, newVec);
-    }
 
-    bool exists(std::shared_ptr<Node>& ptr)
-    {
-        return static_cast<bool>(ptr);
+        pool.invoke([&]() { extractParallel(pool, slot * 2, out); },
+                    [&]() { extractParallel(pool, slot * 2 + 1, out + leftSize + 1); });
     }
 
-    // Makes m_sortedVals a sorted vector of the subtree denoted by startingIndex in linear time
-    // 1) goes to minimum value (leftmost node)
-    // 2) checks left; if left exists and is not already in m_sortedVals it travels there
-    // 3) checks current node; if current is not in m_sortedVals it adds it
-    // 4) checks right; if right is not in m_sortedVals it travels there
-    // 5) travels upwards. if the current node is our starting node we stop here rather than traveling upwards
-    void getSortedVals(int startingIndex)
+    // medianBalance() for balance(pool). Every page it can touch must already exist
+    template<typename RandomIt>
+    int placeParallel(WorkStealingPool& pool, RandomIt first, std::size_t beg, std::size_t end, std::size_t slot)
     {
-        m_sortedVals.clear();
-        int currentInd = startingIndex;
-
-        // base case: wants to climb above the starting index
-        while (true)
+        if (beg == end)
         {
-            if (!withinCapacity(currentInd * 2 + 1))
-            {
-                incCapacity();
-            }
-            // check left
-            if (static_cast<bool>(m_nodePtrs[currentInd * 2]))
-            {
-                if ((!m_sortedVals.empty()) && (compare(m_nodePtrs[currentInd * 2]->getVal(), m_sortedVals.back().m_data) <= 0))
-                {
-                    // ignore, since the value is already in m_sortedVals if it's less than the end element. m_sortedVals
-                    // will only be empty when we're finding the leftmost node to start, and we don't want to do comparisons
-                    // if it's empty. 
-                }
-                else
-                {
-                    currentInd = currentInd * 2; // go left
-                    continue;
-                }
-            }
-
-            // check current
-            if (m_sortedVals.empty())
-            {
-                m_sortedVals.push_back(ValStruct(m_nodePtrs[currentInd]));
-            }
-            else if ( compare(m_nodePtrs[currentInd]->getVal(), m_sortedVals.back().m_data) == 1 )
-            {
-                m_sortedVals.push_back(ValStruct(m_nodePtrs[currentInd]));
-            }
-
-            // check right
-            if (static_cast<bool>(m_nodePtrs[currentInd * 2 + 1]))
-            {
-                if ( compare(m_nodePtrs[currentInd * 2 + 1]->getVal(), m_sortedVals.back().m_data) == 1)
-                {
-                    currentInd = currentInd * 2 + 1; // go right
-                    continue;
-                }
-                else
-                {
-                    // ignore
-                }
-            }
+            return 0;
+        }
 
-            // check stop condition
-            if ( currentInd == startingIndex )
-            {
-                break;
-            }
-            else
-            {
-                currentInd = currentInd / 2; // climb up
-            }
+        std::size_t mid = beg + (end - beg) / 2;
+        Node& node = m_slots.occupyConcurrent(slot);
+        assignSlot(node, first[mid]);
+        int leftSize = 0;
+        int rightSize = 0;
+        if (end - beg < PARALLEL_CUTOFF)
+        {
+            leftSize = placeParallel(pool, first, beg, mid, slot * 2);
+            rightSize = placeParallel(pool, first, mid + 1, end, slot * 2 + 1);
+        }
+        else
+        {
+            pool.invoke([&]() { leftSize = placeParallel(pool, first, beg, mid, slot * 2); },
+                        [&]() { rightSize = placeParallel(pool, first, mid + 1, end, slot * 2 + 1); });
         }
+        int size = node.count() + leftSize + rightSize;
+        m_slots.addSubtreeSize(slot, size);
+        return size;
     }
 
-    // where barren = no children
-    // Note: this algorithm is nearly identical to getSortedVals()
-    int getNumBarren(int startingIndex)
+    // anything weaker than random access is gathered first so the median split can index into it
+    template<typename InputIt>
+    void buildFromSorted(InputIt first, InputIt last, std::input_iterator_tag)
     {
-        m_sortedVals.clear();
-        int currentInd = startingIndex;
-        int numChildren = 0;
-        int numBarren = 0;
+        std::vector<T> vals(first, last);
+        buildFromSorted(std::make_move_iterator(vals.begin()), std::make_move_iterator(vals.end()),
+                        std::random_access_iterator_tag());
+    }
 
-        while (true)
+    // Runs the same descent as findIndex() for every key, BATCH_WIDTH keys at a time. Each round moves
+    // every unfinished descent down one level and prefetches its next slot. Once a descent hits the
+    // key or an open slot, finish(i, slot, rankSum) is called with the slot it stopped on; rankSum is
+    // only accumulated when countRank is set
+    template<typename Finish>
+    void descendBatch(const T* keys, std::size_t count, bool countRank, Finish finish) const
+    {
+        std::size_t slots[BATCH_WIDTH];
+        int rankSums[BATCH_WIDTH];
+        std::size_t active[BATCH_WIDTH];
+
+        for (std::size_t start = 0; start < count; start += BATCH_WIDTH)
         {
-            if (!withinCapacity(currentInd * 2 + 1))
+            std::size_t width = (count - start < BATCH_WIDTH) ? count - start : BATCH_WIDTH;
+            std::size_t numActive = width;
+            for (std::size_t jj = 0; jj < width; ++jj)
             {
-                incCapacity();
+                slots[jj] = ROOT_INDEX;
+                rankSums[jj] = 0;
+                active[jj] = jj;
             }
-            numChildren = 0;
 
-            // check left
-            if (static_cast<bool>(m_nodePtrs[currentInd * 2]))
+            while (numActive > 0)
             {
-                numChildren++;
-                if ((!m_sortedVals.empty()) && (compare(m_nodePtrs[currentInd * 2]->getVal(), m_sortedVals.back().m_data) <= 0))
+                std::size_t stillActive = 0;
+                for (std::size_t aa = 0; aa < numActive; ++aa)
                 {
-                    // ignore, since the value is already in m_sortedVals if it's less than the end element. m_sortedVals
-                    // will only be empty when we're finding the leftmost node to start, and we don't want to do comparisons
-                    // if it's empty. 
-                }
-                else
-                {
-                    currentInd = currentInd * 2; // go left
-                    continue;
-                }
-            }
-
-            // check current
-            if (m_sortedVals.empty())
-            {
-                m_sortedVals.push_back(ValStruct(m_nodePtrs[currentInd]));
-            }
-            else if ( compare(m_nodePtrs[currentInd]->getVal(), m_sortedVals.back().m_data) == 1 )
-            {
-                m_sortedVals.push_back(ValStruct(m_nodePtrs[currentInd]));
-            }
+                    std::size_t jj = active[aa];
+                    const Node* node = m_slots.get(slots[jj]);
+                    int result = (node == nullptr) ? 0 : compare(keys[start + jj], node->getVal());
+                    if (result == 0)
+                    {
+                        finish(start + jj, slots[jj], rankSums[jj]);
+                        continue;
+                    }
 
-            // check right
-            if (static_cast<bool>(m_nodePtrs[currentInd * 2 + 1]))
-            {
-                numChildren++;
-                if ( compare(m_nodePtrs[currentInd * 2 + 1]->getVal(), m_sortedVals.back().m_data) == 1)
-                {
-                    currentInd = currentInd * 2 + 1; // go right
-                    continue;
-                }
-                else
-                {
-                    // ignore
+                    if (result > 0)
+                    {
+                        if (countRank)
+                        {
+                            rankSums[jj] += m_slots.subtreeSize(slots[jj] * 2) + node->count();
+                        }
+                        slots[jj] = slots[jj] * 2 + 1;
+                    }
+                    else
+                    {
+                        slots[jj] = slots[jj] * 2;
+                    }
+                    m_slots.prefetch(slots[jj]);
+                    active[stillActive++] = jj;
                 }
-            }
-
-            if (numChildren == 0)
-            {
-                numBarren++;
-            }
-
-            // check stop condition
-            if ( currentInd == startingIndex )
-            {
-                return numBarren;
-            }
-            else
-            {
-                currentInd = currentInd / 2; // climb up
+                numActive = stillActive;
             }
         }
-
-    }
-
-    void medianBalance(const std::vector<ValStruct>& vals, int beg, int end)
-    {
-    	// Base cases: subarray of size 0 or 1
-    	if (end - beg == 1)
-    	{
-    		medianInsert(vals, beg);
-    		return;
-    	}
-    	else if (end - beg == 0)
-    	{
-    		return;
-    	}
-    	else
-    	{
-    		int mid = beg + (end - beg) / 2;
-    		medianInsert(vals, mid);
-    		medianBalance(vals, beg, mid);
-    		medianBalance(vals, mid+1, end);
-    	}
-    }
-
-    void medianInsert(const std::vector<ValStruct>& vals, int valPos)
-    {
-    	int treePos = findIndex(vals[valPos].m_data);
-    	m_nodePtrs[treePos] = vals[valPos].m_ptr;
     }
 
-	int findIndex (const T& value)
+	std::size_t findIndex (const T& value) const
 	{
-		int currentInd = ROOT_INDEX; 
+		std::size_t currentInd = ROOT_INDEX; 
+		std::uint64_t levels = 0;
 
         // we'll continue traversing the tree until the value's location is found
         while (true)
         {
+            const Node* node = m_slots.get(currentInd);
+
         	// if the spot is empty, return the index
-        	if (!static_cast<bool>(m_nodePtrs[currentInd]))
+        	if (node == nullptr)
         	{
+        		Stats::onDescent(levels);
         		return currentInd;
         	}
 
+            // one comparison decides between found, left and right
+            int result = compare(value, node->getVal());
+            ++levels;
+
         	// if the value is already in the tree, return the index 
-            else if (compare(value, m_nodePtrs[currentInd]->getVal()) == 0)
+            if (result == 0)
             {
+                Stats::onDescent(levels);
                 return currentInd;
             }
 
             else
             {
-            	currentInd = getNext(value, currentInd);
+            	currentInd = getNext(result, currentInd);
             }   
         }
 	}
 
-	int getNext (const T& value, int currentInd)
+	// result is the three-way comparison of the key being looked for against the key at currentInd
+	std::size_t getNext (int result, std::size_t currentInd) const
 	{
-    	if (!withinCapacity(currentInd * 2 + 1))
-    	{
-    		incCapacity();
-    	}
-
-		if (compare(value, m_nodePtrs[currentInd]->getVal()) == 1)
+		if (result > 0)
 		{
 			return currentInd * 2 + 1; // go right
 		}
 
-		else if (compare(value, m_nodePtrs[currentInd]->getVal()) == -1)
-		{
-			return currentInd * 2; // go left 
-		}
-
-        return 0;
+		return currentInd * 2; // go left 
 	}
 
-    static int cmp(const T& val1,const T& val2)
+    // Number of keys less than value (or not greater, with inclusive set), whether or not value is in
+    // the tree. Same descent as rank(), but it runs down to an open slot instead of stopping at a match
+    int countBelow(const T& value, bool inclusive) const
+    {
+        std::size_t current = ROOT_INDEX;
+        int count = 0;
+        while (const Node* node = m_slots.get(current))
+        {
+            int result = compare(value, node->getVal());
+            if (result == 0)
+            {
+                return count + nodeSize(current * 2) + (inclusive ? node->count() : 0);
+            }
+            else if (result > 0)
+            {
+                count += nodeSize(current * 2) + node->count();
+                current = current * 2 + 1;
+            }
+            else
+            {
+                current = current * 2;
+            }
+        }
+        return count;
+    }
+
+    // single descent that remembers the last node where it went left. With inclusive set, a node
+    // equal to value counts as a bound and ends the search
+    const_iterator boundSearch(const T& value, bool inclusive) const
+    {
+        std::size_t current = ROOT_INDEX;
+        std::size_t bound = END_SLOT;
+        while (const Node* node = m_slots.get(current))
+        {
+            int result = compare(value, node->getVal());
+            if (result == 0 && inclusive)
+            {
+                return const_iterator(this, current);
+            }
+            if (result < 0)
+            {
+                bound = current;
+                current = current * 2;
+            }
+            else
+            {
+                current = current * 2 + 1;
+            }
+        }
+        return const_iterator(this, bound);
+    }
+
+    // the slot must be occupied
+    std::size_t leftmost(std::size_t currentInd) const
     {
-        if (val1 < val2) 
+        while (exists(currentInd * 2))
         {
-            return -1;
+            currentInd = currentInd * 2;
         }
-        else if (val1 > val2) 
+        return currentInd;
+    }
+
+    // the slot must be occupied
+    std::size_t rightmost(std::size_t currentInd) const
+    {
+        while (exists(currentInd * 2 + 1))
         {
-            return 1;
+            currentInd = currentInd * 2 + 1;
         }
-        else 
+        return currentInd;
+    }
+
+    // In-order successor of an occupied slot, or END_SLOT after the largest key. Without a right
+    // subtree, the successor is the first ancestor we are in the left subtree of: climb past every
+    // right child (the trailing 1 bits of the index) and then one more level. Climbing off the root
+    // lands on 0, which is END_SLOT
+    std::size_t nextSlot(std::size_t currentInd) const
+    {
+        if (exists(currentInd * 2 + 1))
         {
-            return 0;
+            return leftmost(currentInd * 2 + 1);
+        }
+        // shifted in two steps so a run of 63 right turns doesn't shift by the full width
+        return (currentInd >> __builtin_ctzll(~static_cast<unsigned long long>(currentInd))) >> 1;
+    }
+
+    // mirror image of nextSlot(): climb past every left child (trailing 0 bits) and one more level
+    std::size_t prevSlot(std::size_t currentInd) const
+    {
+        if (exists(currentInd * 2))
+        {
+            return rightmost(currentInd * 2);
         }
+        return (currentInd >> __builtin_ctzll(static_cast<unsigned long long>(currentInd))) >> 1;
     }
 
-	int largest(int currentInd)
+	std::size_t largest(std::size_t currentInd)
     {
         if ( !hasChildren(currentInd) )
         {
@@ -853,7 +1829,7 @@ private:
         
     }
 
-	int smallest(int currentInd)
+	std::size_t smallest(std::size_t currentInd)
     {
         if ( !hasChildren(currentInd) )
         {
@@ -879,79 +1855,190 @@ private:
 		}      
     }
 
-    bool hasChildren(const int& currentInd)
+    bool hasChildren(std::size_t currentInd) const
     {
-    	if (!withinCapacity(currentInd * 2 + 1))
-    	{
-    		incCapacity();
-    	}
-
-    	if (static_cast<bool>(m_nodePtrs[currentInd * 2]) || static_cast<bool>(m_nodePtrs[currentInd * 2 + 1]))
+    	if (exists(currentInd * 2) || exists(currentInd * 2 + 1))
     	{
     		return true;
     	}
     	return false;
     }
 
-    bool hasR(const int& currentInd)
+    bool hasR(std::size_t currentInd) const
     {
-    	if (!withinCapacity(currentInd * 2 + 1))
-    	{
-    		incCapacity();
-    	}
-
-    	if (static_cast<bool>(m_nodePtrs[currentInd * 2 + 1]))
+    	if (exists(currentInd * 2 + 1))
     	{
     		return true;
     	}
     	return false;
     }
 
-    bool hasL(const int& currentInd)
+    bool hasL(std::size_t currentInd) const
     {
-    	if (!withinCapacity(currentInd * 2 + 1))
-    	{
-    		incCapacity();
-    	}
-
-    	if (static_cast<bool>(m_nodePtrs[currentInd * 2]))
+    	if (exists(currentInd * 2))
     	{
     		return true;
     	}
     	return false;
     }
 
-    bool withinCapacity(const uint32_t ind) 
+    // Fills pos with value unless the key is already there (pos came from findIndex, so an occupied
+    // slot means a duplicate). A multiset counts the duplicate instead
+    template<typename U>
+    bool insertAt(std::size_t pos, U&& value)
     {
-    	if (ind < m_nodePtrs.size())
-    	{
-    		return true;
-    	}
-    	return false; 
+    	// if the spot is empty, we can insert it
+        if (!exists(pos))
+        {
+            if (pos > MAX_SLOT_INDEX)
+            {
+                throw std::length_error( "Tree is too deep to add another level; call balance()" );
+            }
+
+        	fillSlot(pos, std::forward<U>(value));
+        	logChange(LOG_INSERT, &m_slots.value(pos).m_data, 1);
+        	if (m_alpha > 0)
+        	{
+        		rebalanceAfterInsert(pos);
+        	}
+        	return true; 
+        }
+        else if (Keys::MULTISET)
+        {
+            changeCount(pos, 1);
+            logChange(LOG_INSERT, &valAt(pos), countAt(pos));
+            return true;
+        }
+        // if the spot is taken, it means this is a duplicate
+        else
+        {
+        	return false;
+        }
     }
 
-    void incCapacity()
+    // Swaps the key at toRemove down the tree until it sits in a slot with no children and returns that
+    // slot. Each swap is with the in-order neighbour, so the order of the other keys is kept
+    std::size_t sinkToLeaf(std::size_t toRemove)
     {
-    	// double the size of our vector (and add 1) and insert a bunch of nullptrs
-        // the +1 is necessary because the root starts at index 1 instead of 0
-    	int newSize = m_nodePtrs.size() + 1;
-    	for (int i = 0; i < newSize; ++i)
-    	{
-	    	m_nodePtrs.push_back(std::shared_ptr<Node>());
-    	}
+        if (!hasChildren(toRemove))
+        {
+        	return toRemove;
+        }
+
+        else
+        {
+        	if (hasR(toRemove))
+        	{
+        		// if R doesn't have a left child, we need to manually swap it. Otherwise
+        		// smallest() will find the smallest of R rather than toRemove
+        		if (!hasL(toRemove * 2 + 1))
+        		{
+        			std::size_t toSwap = toRemove * 2 + 1;
+	        		swap(toRemove, toSwap); 
+	        		toRemove = toSwap;        			
+        		}
+        		else
+        		{
+	        		std::size_t toSwap = smallest(toRemove * 2 + 1);
+	        		swap(toRemove, toSwap); 
+	        		toRemove = toSwap;        			
+        		}
+
+        		while(hasChildren(toRemove))
+        		{
+        			std::size_t toSwap = smallest(toRemove);
+        			swap(toRemove, toSwap);
+	        		toRemove = toSwap;
+        		}
+
+        		return toRemove;
+        	}
+        	else if (hasL(toRemove))
+        	{
+        		if (!hasR(toRemove * 2))
+        		{
+        			std::size_t toSwap = toRemove * 2;
+	        		swap(toRemove, toSwap); 
+	        		toRemove = toSwap;        			
+        		}
+        		else
+        		{
+	        		std::size_t toSwap = largest(toRemove * 2);
+	        		swap(toRemove, toSwap); 
+	        		toRemove = toSwap;        			
+        		}
+
+        		while(hasChildren(toRemove))
+        		{
+        			std::size_t toSwap = largest(toRemove);
+        			swap(toRemove, toSwap);
+	        		toRemove = toSwap;
+        		}
+
+        		return toRemove;
+        	}
+        }  
+        return toRemove;
+    }
+
+	// Both slots are occupied whenever remove() calls this, and rInd is below lInd, so only the keys
+	// move. In multiset mode their counts go along, and the sizes between the two slots take the difference
+	void swap(std::size_t lInd, std::size_t rInd)
+    {
+        Stats::onRemoveSwap();
+        if (Keys::MULTISET)
+        {
+            int lCount = countAt(lInd);
+            int rCount = countAt(rInd);
+            for (std::size_t slot = rInd; slot != lInd; slot /= 2)
+            {
+                m_slots.addSubtreeSize(slot, lCount - rCount);
+            }
+            m_slots.value(lInd).setCount(rCount);
+            m_slots.value(rInd).setCount(lCount);
+        }
+        using std::swap;
+        swap(m_slots.value(lInd).m_data, m_slots.value(rInd).m_data);
+    }
+
+    // the slot must be open; its ancestors' subtree sizes are bumped to account for the new node
+    template<typename U>
+    void fillSlot(std::size_t index, U&& value)
+    {
+        m_slots.occupy(index).m_data = std::forward<U>(value);
+        adjustSizes(index, 1);
     }
 
-	void swap(std::vector<std::shared_ptr<Node> >& vec, int lInd, int rInd)
+    // open the slot and drop the key it held so any resources the key owns are released. Only
+    // leaves with a count of 1 are ever cleared, so the slot and its ancestors each lose exactly one
+    void clearSlot(std::size_t index)
     {
-        auto temp = vec[lInd];
-        vec[lInd] = vec[rInd];
-        vec[rInd] = temp;
-    } 
+        adjustSizes(index, -1);
+        m_slots.vacate(index);
+    }
+
+    // walks from index up to the root, adding delta to every subtree size along the way
+    void adjustSizes(std::size_t index, int delta)
+    {
+        while (index >= ROOT_INDEX)
+        {
+            m_slots.addSubtreeSize(index, delta);
+            index = index / 2;
+        }
+    }
 
 };
 
+// same tree with a comparator chosen at runtime, eg. from a std::function<int(T,T)>
 template<typename T>
-std::ostream& operator<< (std::ostream& os, MySearchTree<T>& tree) 
+using DynamicSearchTree = MySearchTree<T, RuntimeCompare<T> >;
+
+// multiset with a count next to each key (see multiplicity.h)
+template<typename T, typename Compare = ThreeWayCompare<T> >
+using MultiSearchTree = MySearchTree<T, Compare, std::allocator<T>, NoStats, CountedKeys>;
+
+template<typename T, typename Compare, typename Allocator, typename Stats, typename Keys>
+std::ostream& operator<< (std::ostream& os, MySearchTree<T, Compare, Allocator, Stats, Keys>& tree) 
 {
     std::stringstream outString;
     tree.prettyPrint(outString);
@@ -1,10 +1,21 @@
 #include "unittests.h"
 #include "tree.h"
+#include "concurrenttree.h"
+#include "versionedtree.h"
 #include <iostream>
 #include <algorithm>
 #include <vector>
 #include <ctime>
 #include <sstream>
+#include <list>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <csignal>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 Test_Registrar<TreeTests> TreeTests::registrar;
 
@@ -440,4 +451,1534 @@ bool TreeTests::singleElementTest()
 	}
 
 	return true;
-}
\ No newline at end of file
+}
+// keys live inline in the slot array, so make sure a key type that owns memory survives
+// removal swaps and a full rebalance
+bool TreeTests::stringKeys()
+{
+	MySearchTree<std::string> tree;
+	VERIFY_TRUE(tree.insert("mango"));
+	VERIFY_TRUE(tree.insert("apple"));
+	VERIFY_TRUE(tree.insert("pear"));
+	VERIFY_TRUE(tree.insert("banana"));
+	VERIFY_TRUE(tree.insert("zucchini"));
+	VERIFY_TRUE(!tree.insert("pear"));
+
+	VERIFY_TRUE(tree.remove("mango"));
+	VERIFY_TRUE(!tree.contains("mango"));
+	VERIFY_EQ(tree.getRoot()->getVal(), std::string("pear"));
+	VERIFY_EQ(tree.rank(std::string("zucchini")), 3);
+
+	tree.balance();
+	VERIFY_TRUE(tree.contains("apple"));
+	VERIFY_TRUE(tree.contains("banana"));
+	VERIFY_TRUE(tree.contains("pear"));
+	VERIFY_TRUE(tree.contains("zucchini"));
+	VERIFY_EQ(tree.size(tree.getRoot()->getVal()), 4);
+
+	return true;
+}
+
+// the frozen snapshot has to agree with the tree it came from, and stay put when the tree changes
+bool TreeTests::freezeTest()
+{
+	MySearchTree<int> empty;
+	FrozenSearchTree<int> emptySnapshot = empty.freeze();
+	VERIFY_EQ(emptySnapshot.size(), 0);
+	VERIFY_TRUE(!emptySnapshot.contains(3));
+	VERIFY_TRUE(emptySnapshot.lower_bound(3) == nullptr);
+
+	MySearchTree<int> tree;
+	for (int val : {50, 20, 80, 10, 30, 70, 90, 60})
+	{
+		VERIFY_TRUE(tree.insert(val));
+	}
+	FrozenSearchTree<int> snapshot = tree.freeze();
+	VERIFY_EQ(snapshot.size(), 8);
+
+	for (int val = 0; val <= 100; ++val)
+	{
+		VERIFY_EQ(snapshot.contains(val), tree.contains(val));
+		VERIFY_EQ(snapshot.rank(val), tree.rank(val));
+	}
+	VERIFY_EQ(*snapshot.lower_bound(0), 10);
+	VERIFY_EQ(*snapshot.lower_bound(31), 50);
+	VERIFY_EQ(*snapshot.lower_bound(90), 90);
+	VERIFY_TRUE(snapshot.lower_bound(91) == nullptr);
+
+	VERIFY_TRUE(tree.remove(30));
+	VERIFY_TRUE(!tree.contains(30));
+	VERIFY_TRUE(snapshot.contains(30));
+
+	return true;
+}
+
+bool TreeTests::sizeAfterRemove()
+{
+	MySearchTree<int> tree;
+	for (int val : {10, 5, 20, 15, 25, 17, 12})
+	{
+		VERIFY_TRUE(tree.insert(val));
+	}
+	VERIFY_EQ(tree.size(10), 7);
+	VERIFY_EQ(tree.size(20), 5);
+	VERIFY_EQ(tree.rank(25), 6);
+
+	// 20 has two children, so its successor 25 gets swapped up before the leaf is cleared
+	VERIFY_TRUE(tree.remove(20));
+	VERIFY_EQ(tree.size(10), 6);
+	VERIFY_EQ(tree.size(25), 4);
+	VERIFY_EQ(tree.rank(25), 5);
+	VERIFY_EQ(tree.rank(17), 4);
+	VERIFY_EQ(tree.rank(20), 0);
+	VERIFY_EQ(tree.size(20), 0);
+
+	tree.balance();
+	VERIFY_EQ(tree.size(tree.getRoot()->getVal()), 6);
+	VERIFY_EQ(tree.rank(5), 0);
+	VERIFY_EQ(tree.rank(12), 2);
+	VERIFY_EQ(tree.rank(25), 5);
+
+	return true;
+}
+
+// every key lands one level deeper than the last, so slot indices go all the way up to 2^62
+// std::allocator that throws std::bad_alloc while s_fail is set
+template<typename T>
+struct FailingAllocator
+{
+    typedef T value_type;
+    static bool s_fail;
+
+    FailingAllocator() {}
+    template<typename U>
+    FailingAllocator(const FailingAllocator<U>&) {}
+
+    T* allocate(std::size_t count)
+    {
+        if (FailingAllocator<char>::s_fail)
+        {
+            throw std::bad_alloc();
+        }
+        return std::allocator<T>().allocate(count);
+    }
+    void deallocate(T* pointer, std::size_t count) { std::allocator<T>().deallocate(pointer, count); }
+
+    template<typename U>
+    bool operator==(const FailingAllocator<U>&) const { return true; }
+    template<typename U>
+    bool operator!=(const FailingAllocator<U>&) const { return false; }
+};
+template<typename T>
+bool FailingAllocator<T>::s_fail = false;
+
+bool TreeTests::sortedInsert()
+{
+	MySearchTree<int> tree;
+	for (int val = 0; val < 63; ++val)
+	{
+		VERIFY_TRUE(tree.insert(val));
+	}
+	for (int val = 0; val < 63; ++val)
+	{
+		VERIFY_TRUE(tree.contains(val));
+		VERIFY_EQ(tree.rank(val), val);
+		VERIFY_EQ(tree.size(val), 63 - val);
+	}
+	VERIFY_TRUE(!tree.contains(64));
+
+	// one more level would leave no room to address its children
+	bool threw = false;
+	try
+	{
+		tree.insert(63);
+	}
+	catch (const std::length_error&)
+	{
+		threw = true;
+	}
+	VERIFY_TRUE(threw);
+
+	VERIFY_TRUE(!tree.contains(63));
+	VERIFY_TRUE(tree.remove(62));
+	VERIFY_TRUE(tree.remove(0));
+	VERIFY_EQ(tree.rank(61), 60);
+
+	tree.balance();
+	VERIFY_TRUE(tree.insert(63));
+	VERIFY_EQ(tree.size(tree.getRoot()->getVal()), 62);
+
+	// a page that fails to allocate deep in the sparse range leaves nothing half made behind
+	MySearchTree<int, ThreeWayCompare<int>, FailingAllocator<int> > failing;
+	for (int val = 0; val < 30; ++val)
+	{
+		VERIFY_TRUE(failing.insert(val));
+	}
+	FailingAllocator<char>::s_fail = true;
+	threw = false;
+	try
+	{
+		failing.insert(30);
+	}
+	catch (const std::bad_alloc&)
+	{
+		threw = true;
+	}
+	FailingAllocator<char>::s_fail = false;
+	VERIFY_TRUE(threw);
+	VERIFY_FALSE(failing.contains(30));
+	VERIFY_EQ(std::distance(failing.begin(), failing.end()), 30);
+	failing.clear();
+	VERIFY_TRUE(failing.begin() == failing.end());
+	VERIFY_EQ(failing.memory_usage().m_pages, 0u);
+	VERIFY_TRUE(failing.insert(30));
+
+	return true;
+}
+
+// sorted inserts would run out of levels after 63 keys, so getting through 10k of them means the
+// partial rebuilds are keeping the depth logarithmic
+bool TreeTests::autoBalance()
+{
+	MySearchTree<int> tree;
+	bool threw = false;
+	try
+	{
+		tree.setAutoBalance(0.4);
+	}
+	catch (const std::invalid_argument&)
+	{
+		threw = true;
+	}
+	VERIFY_TRUE(threw);
+
+	tree.setAutoBalance(0.7);
+	int numInts = 10000;
+	for (int ii = 0; ii < numInts; ++ii)
+	{
+		VERIFY_TRUE(tree.insert(ii));
+	}
+	for (int ii = numInts * 2; ii > numInts; --ii)
+	{
+		VERIFY_TRUE(tree.insert(ii));
+	}
+
+	VERIFY_EQ(tree.size(tree.getRoot()->getVal()), numInts * 2);
+	for (int ii = 0; ii < numInts; ii += 97)
+	{
+		VERIFY_TRUE(tree.contains(ii));
+		VERIFY_EQ(tree.rank(ii), ii);
+	}
+	VERIFY_TRUE(!tree.contains(numInts));
+	VERIFY_EQ(tree.rank(numInts * 2), numInts * 2 - 1);
+
+	return true;
+}
+
+// bulk construction has to land every key exactly where balance() would have put it
+bool TreeTests::buildFromSorted()
+{
+	std::vector<int> vals = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+	MySearchTree<int> built(vals.begin(), vals.end());
+
+	MySearchTree<int> balanced;
+	for (int val : {10, 9, 8, 7, 6, 5, 4, 3, 2, 1})
+	{
+		VERIFY_TRUE(balanced.insert(val));
+	}
+	balanced.balance();
+
+	std::stringstream builtOutput;
+	built.prettyPrint(builtOutput);
+	std::stringstream balancedOutput;
+	balanced.prettyPrint(balancedOutput);
+	VERIFY_EQ(builtOutput.str(), balancedOutput.str());
+	VERIFY_EQ(built.getRoot()->getVal(), 6);
+	VERIFY_EQ(built.size(6), 10);
+	VERIFY_EQ(built.rank(10), 9);
+
+	// a non random access range replaces whatever was there before
+	std::list<int> evens = {2, 4, 6, 8};
+	built.build_from_sorted(evens.begin(), evens.end());
+	VERIFY_TRUE(!built.contains(1));
+	VERIFY_TRUE(built.contains(8));
+	VERIFY_EQ(built.size(built.getRoot()->getVal()), 4);
+	VERIFY_TRUE(built.insert(5));
+	VERIFY_EQ(built.rank(5), 2);
+
+	built.build_from_sorted(evens.end(), evens.end());
+	VERIFY_TRUE(built.getRoot() == nullptr);
+
+	return true;
+}
+
+// batches that are longer than one group and mix hits with misses on both sides of the tree
+bool TreeTests::batchLookup()
+{
+	MySearchTree<int> tree;
+	for (int val : {40, 20, 60, 10, 30, 50, 70, 5, 65})
+	{
+		VERIFY_TRUE(tree.insert(val));
+	}
+
+	std::vector<int> keys;
+	for (int val = 0; val <= 75; ++val)
+	{
+		keys.push_back(val);
+	}
+
+	std::unique_ptr<bool[]> found(new bool[keys.size()]);
+	std::vector<const int*> stored(keys.size());
+	std::vector<int> ranks(keys.size());
+	tree.contains_batch(keys.data(), keys.size(), found.get());
+	tree.find_batch(keys.data(), keys.size(), stored.data());
+	tree.rank_batch(keys.data(), keys.size(), ranks.data());
+
+	for (std::size_t ii = 0; ii < keys.size(); ++ii)
+	{
+		VERIFY_EQ(found[ii], tree.contains(keys[ii]));
+		VERIFY_EQ(stored[ii] != nullptr, found[ii]);
+		if (stored[ii] != nullptr)
+		{
+			VERIFY_EQ(*stored[ii], keys[ii]);
+		}
+		VERIFY_EQ(ranks[ii], tree.rank(keys[ii]));
+	}
+
+	tree.contains_batch(keys.data(), 0, found.get());
+	return true;
+}
+
+// enough keys for several multi-level steps plus leftover scalar levels, and batches with a ragged tail
+template<typename T>
+static bool checkFrozenBatch()
+{
+	std::vector<T> vals;
+	for (int ii = 0; ii < 1500; ++ii)
+	{
+		vals.push_back(static_cast<T>(ii * 2 - 1000));
+	}
+	MySearchTree<T> tree(vals.begin(), vals.end());
+	FrozenSearchTree<T> snapshot = tree.freeze();
+
+	std::vector<T> probes;
+	for (int ii = -1003; ii < 2003; ++ii)
+	{
+		probes.push_back(static_cast<T>(ii));
+	}
+	std::unique_ptr<bool[]> found(new bool[probes.size()]);
+	std::vector<int> ranks(probes.size());
+	snapshot.contains_batch(probes.data(), probes.size(), found.get());
+	snapshot.rank_batch(probes.data(), probes.size(), ranks.data());
+
+	for (std::size_t ii = 0; ii < probes.size(); ++ii)
+	{
+		bool expected = tree.contains(probes[ii]);
+		VERIFY_EQ(snapshot.contains(probes[ii]), expected);
+		VERIFY_EQ(found[ii], expected);
+		VERIFY_EQ(snapshot.rank(probes[ii]), tree.rank(probes[ii]));
+		VERIFY_EQ(ranks[ii], tree.rank(probes[ii]));
+	}
+	return true;
+}
+
+bool TreeTests::freezeBatchLookup()
+{
+	VERIFY_TRUE(checkFrozenBatch<int>());
+	VERIFY_TRUE(checkFrozenBatch<long long>());
+	VERIFY_TRUE(checkFrozenBatch<float>());
+	VERIFY_TRUE(checkFrozenBatch<double>());
+	return true;
+}
+
+// the same keys under a bool comparator, a reversed three-way one and one picked at runtime
+bool TreeTests::comparatorPolicy()
+{
+	// stateless comparators don't take up any room
+	VERIFY_TRUE((std::is_empty<CompareHolder<int, std::less<int> > >::value));
+
+	MySearchTree<int, std::greater<int> > descending;
+	DynamicSearchTree<int> dynamic(std::function<int(int,int)>([](int lhs, int rhs)
+	{
+		return (lhs > rhs) ? -1 : (lhs < rhs);
+	}));
+	for (int val : {40, 20, 60, 10, 30, 50, 70})
+	{
+		VERIFY_TRUE(descending.insert(val));
+		VERIFY_TRUE(dynamic.insert(val));
+	}
+	VERIFY_FALSE(descending.insert(30));
+	VERIFY_FALSE(dynamic.insert(30));
+
+	for (int val : {40, 20, 60, 10, 30, 50, 70})
+	{
+		VERIFY_TRUE(descending.contains(val));
+		VERIFY_EQ(descending.rank(val), (70 - val) / 10);
+		VERIFY_EQ(dynamic.rank(val), (70 - val) / 10);
+	}
+	VERIFY_FALSE(dynamic.contains(35));
+
+	FrozenSearchTree<int, std::greater<int> > snapshot = descending.freeze();
+	VERIFY_EQ(*snapshot.lower_bound(45), 40);
+	VERIFY_EQ(snapshot.rank(10), 6);
+
+	VERIFY_TRUE(descending.remove(40));
+	VERIFY_FALSE(descending.contains(40));
+	VERIFY_EQ(descending.rank(30), 3);
+	return true;
+}
+
+// readers share the tree while a writer keeps inserting keys they never look for
+bool TreeTests::concurrentReads()
+{
+	ConcurrentSearchTree<int> tree;
+	tree.setAutoBalance(0.75); // the keys go in sorted, which would be too deep otherwise
+	for (int val = 0; val < 1000; val += 2)
+	{
+		tree.insert(val);
+	}
+
+	std::atomic<int> mismatches(0);
+	std::vector<std::thread> readers;
+	for (int tt = 0; tt < 4; ++tt)
+	{
+		readers.emplace_back([&]()
+		{
+			for (int round = 0; round < 20; ++round)
+			{
+				for (int val = 0; val < 1000; ++val)
+				{
+					if (tree.contains(val) != (val % 2 == 0))
+					{
+						++mismatches;
+					}
+				}
+			}
+		});
+	}
+	for (int val = 1001; val < 3000; val += 2)
+	{
+		tree.insert(val);
+	}
+	for (std::thread& reader : readers)
+	{
+		reader.join();
+	}
+
+	VERIFY_EQ(mismatches.load(), 0);
+	VERIFY_EQ(tree.rank(998), 499);
+	VERIFY_EQ(tree.freeze().size(), 1500);
+
+	// the plain tree can be read through a const reference
+	std::vector<int> vals = {1, 2, 3};
+	const MySearchTree<int> built(vals.begin(), vals.end());
+	VERIFY_TRUE(built.contains(2));
+	VERIFY_EQ(built.rank(3), 2);
+	VERIFY_EQ(built.size(2), 3);
+	VERIFY_EQ(built.getRoot()->getVal(), 2);
+	return true;
+}
+
+bool TreeTests::versionedReads()
+{
+	VersionedSearchTree<int> tree;
+	tree.update([](MySearchTree<int>& draft)
+	{
+		for (int val = 0; val < 1000; val += 2)
+		{
+			draft.insert(val * 7919 % 1000);
+		}
+	});
+
+	// a pinned version doesn't see later writes
+	VersionedSearchTree<int>::Snapshot before = tree.snapshot();
+	VERIFY_TRUE(tree.insert(1));
+	VERIFY_FALSE(tree.insert(1));
+	VERIFY_FALSE(before->contains(1));
+	VERIFY_TRUE(tree.contains(1));
+	VERIFY_TRUE(tree.remove(1));
+
+	std::atomic<bool> done(false);
+	std::atomic<int> mismatches(0);
+	std::vector<std::thread> readers;
+	for (int tt = 0; tt < 4; ++tt)
+	{
+		readers.emplace_back([&]()
+		{
+			while (!done)
+			{
+				for (int val = 0; val < 1000; val += 2)
+				{
+					if (!tree.contains(val) || tree.rank(val) != val / 2)
+					{
+						++mismatches;
+					}
+				}
+			}
+		});
+	}
+	for (int round = 0; round < 20; ++round)
+	{
+		tree.balance();
+	}
+	done = true;
+	for (std::thread& reader : readers)
+	{
+		reader.join();
+	}
+
+	VERIFY_EQ(mismatches.load(), 0);
+	VERIFY_FALSE(tree.contains(1));
+	VERIFY_EQ(before->rank(998), 499);
+
+	// readers keep finishing lookups while a writer sits inside a long update()
+	done = false;
+	std::atomic<long> numReads(0);
+	readers.clear();
+	for (int tt = 0; tt < 4; ++tt)
+	{
+		readers.emplace_back([&]()
+		{
+			while (!done)
+			{
+				mismatches += tree.contains(998) ? 0 : 1;
+				++numReads;
+			}
+		});
+	}
+	bool progressed = false;
+	bool sawDraft = false;
+	tree.update([&](MySearchTree<int>& draft)
+	{
+		draft.setAutoBalance(0.75);
+		for (int val = 1001; val < 200000; val += 2)
+		{
+			draft.insert(val);
+		}
+		draft.balance();
+		long readsBefore = numReads.load();
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (!progressed && std::chrono::steady_clock::now() < deadline)
+		{
+			progressed = numReads.load() >= readsBefore + 10000;
+		}
+		sawDraft = tree.contains(1001); // readers only get the published version
+	});
+	done = true;
+	for (std::thread& reader : readers)
+	{
+		reader.join();
+	}
+	VERIFY_TRUE(progressed);
+	VERIFY_FALSE(sawDraft);
+	VERIFY_EQ(mismatches.load(), 0);
+	VERIFY_TRUE(tree.contains(1001));
+	return true;
+}
+
+bool TreeTests::parallelBalance()
+{
+	MySearchTree<int> serial;
+	std::srand(7);
+	for (int ii = 0; ii < 100000; ++ii)
+	{
+		serial.insert(std::rand() % 1000000);
+	}
+	MySearchTree<int> parallel = serial;
+	MySearchTree<int> empty;
+
+	WorkStealingPool pool(4);
+	VERIFY_EQ(empty.balance(pool), 0);
+	VERIFY_EQ(parallel.balance(pool), serial.balance());
+	VERIFY_EQ(parallel.getRoot()->getVal(), serial.getRoot()->getVal());
+
+	// matching subtree sizes everywhere means every key landed in the same slot
+	for (int val = 0; val < 1000000; val += 7)
+	{
+		VERIFY_EQ(parallel.size(val), serial.size(val));
+		VERIFY_EQ(parallel.rank(val), serial.rank(val));
+	}
+	VERIFY_TRUE(parallel.insert(-1));
+	VERIFY_TRUE(parallel.contains(-1));
+	VERIFY_EQ(parallel.size(parallel.getRoot()->getVal()), serial.size(serial.getRoot()->getVal()) + 1);
+	return true;
+}
+
+// walks forwards and backwards against std::set, including a tree that reaches the deepest slots
+bool TreeTests::iterators()
+{
+	MySearchTree<int> empty;
+	VERIFY_TRUE(empty.begin() == empty.end());
+	VERIFY_TRUE(empty.lower_bound(3) == empty.end());
+
+	MySearchTree<int> tree;
+	std::set<int> expected;
+	std::srand(11);
+	for (int ii = 0; ii < 2000; ++ii)
+	{
+		int val = std::rand() % 5000;
+		tree.insert(val);
+		expected.insert(val);
+	}
+
+	VERIFY_TRUE(std::equal(tree.begin(), tree.end(), expected.begin(), expected.end()));
+	std::vector<int> backwards(expected.rbegin(), expected.rend());
+	std::vector<int> walked;
+	for (MySearchTree<int>::const_iterator it = tree.end(); it != tree.begin(); )
+	{
+		walked.push_back(*--it);
+	}
+	VERIFY_TRUE(walked == backwards);
+
+	for (int val = -1; val <= 5001; ++val)
+	{
+		MySearchTree<int>::const_iterator lower = tree.lower_bound(val);
+		MySearchTree<int>::const_iterator upper = tree.upper_bound(val);
+		VERIFY_EQ(lower == tree.end(), expected.lower_bound(val) == expected.end());
+		VERIFY_EQ(upper == tree.end(), expected.upper_bound(val) == expected.end());
+		if (lower != tree.end())
+		{
+			VERIFY_EQ(*lower, *expected.lower_bound(val));
+		}
+		if (upper != tree.end())
+		{
+			VERIFY_EQ(*upper, *expected.upper_bound(val));
+		}
+		auto range = tree.equal_range(val);
+		VERIFY_EQ(std::distance(range.first, range.second), static_cast<std::ptrdiff_t>(expected.count(val)));
+	}
+
+	// 63 levels of right children, so the last climb starts from the deepest slot there is
+	MySearchTree<int> chain;
+	for (int val = 0; val < 63; ++val)
+	{
+		VERIFY_TRUE(chain.insert(val));
+	}
+	int next = 0;
+	for (int val : chain)
+	{
+		VERIFY_EQ(val, next++);
+	}
+	VERIFY_EQ(next, 63);
+	VERIFY_EQ(*--chain.end(), 62);
+	return true;
+}
+
+bool TreeTests::orderStatistics()
+{
+	MySearchTree<int> tree;
+	std::set<int> expected;
+	std::srand(5);
+	for (int ii = 0; ii < 1000; ++ii)
+	{
+		int val = std::rand() % 3000;
+		tree.insert(val);
+		expected.insert(val);
+	}
+
+	int k = 0;
+	for (int val : expected)
+	{
+		VERIFY_EQ(tree.select(k), val);
+		VERIFY_EQ(tree.rank(tree.select(k)), k);
+		++k;
+	}
+	VERIFY_EQ(tree.count_between(-5, 3005), static_cast<int>(expected.size()));
+
+	for (int lo = -2; lo < 3002; lo += 37)
+	{
+		for (int hi = lo - 10; hi < lo + 200; hi += 13)
+		{
+			int inRange = 0;
+			for (std::set<int>::iterator it = expected.lower_bound(lo); it != expected.end() && *it <= hi; ++it)
+			{
+				++inRange;
+			}
+			VERIFY_EQ(tree.count_between(lo, hi), inRange);
+		}
+	}
+
+	bool thrown = false;
+	try
+	{
+		tree.select(static_cast<int>(expected.size()));
+	}
+	catch (const std::out_of_range&)
+	{
+		thrown = true;
+	}
+	VERIFY_TRUE(thrown);
+	VERIFY_EQ(MySearchTree<int>().count_between(1, 2), 0);
+	return true;
+}
+
+// orders unique_ptrs by what they point at
+struct PointeeCompare
+{
+	int operator()(const std::unique_ptr<int>& lhs, const std::unique_ptr<int>& rhs) const
+	{
+		return (*lhs > *rhs) - (*lhs < *rhs);
+	}
+};
+
+bool TreeTests::moveOnlyKeys()
+{
+	MySearchTree<std::unique_ptr<int>, PointeeCompare> tree;
+	for (int val : {40, 20, 60, 10, 30, 50, 70})
+	{
+		VERIFY_TRUE(tree.insert(std::unique_ptr<int>(new int(val))));
+	}
+	VERIFY_TRUE(tree.emplace(new int(35)));
+	VERIFY_FALSE(tree.emplace(new int(35)));
+
+	std::unique_ptr<int> key(new int(30));
+	VERIFY_TRUE(tree.contains(key));
+	VERIFY_EQ(tree.rank(key), 2);
+
+	std::unique_ptr<int> out;
+	VERIFY_TRUE(tree.extract(key, out));
+	VERIFY_EQ(*out, 30);
+	VERIFY_TRUE(out.get() != key.get());
+	VERIFY_FALSE(tree.contains(key));
+	VERIFY_FALSE(tree.extract(key, out));
+	VERIFY_EQ(*out, 30);
+
+	// the root has two children, so its key gets swapped down before it comes out
+	std::unique_ptr<int> root(new int(40));
+	VERIFY_TRUE(tree.extract(root, out));
+	VERIFY_EQ(*out, 40);
+	VERIFY_EQ(tree.balance(), 3);
+	std::vector<int> remaining;
+	for (const std::unique_ptr<int>& stored : tree)
+	{
+		remaining.push_back(*stored);
+	}
+	VERIFY_TRUE((remaining == std::vector<int>{10, 20, 35, 50, 60, 70}));
+
+	// copies aren't needed for strings either
+	MySearchTree<std::string> strings;
+	std::string big(200, 'x');
+	VERIFY_TRUE(strings.insert(std::move(big)));
+	VERIFY_TRUE(strings.emplace(3, 'a'));
+	std::string taken;
+	VERIFY_TRUE(strings.extract("aaa", taken));
+	VERIFY_EQ(taken, std::string("aaa"));
+	return true;
+}
+
+bool TreeTests::slabAllocator()
+{
+	// freed blocks are reused before another slab is taken
+	SlabAllocator<long long> allocator(4);
+	std::vector<long long*> blocks;
+	for (int ii = 0; ii < 6; ++ii)
+	{
+		blocks.push_back(allocator.allocate(1));
+		*blocks.back() = ii;
+	}
+	VERIFY_EQ(allocator.numSlabs(), 2u);
+	for (long long* block : blocks)
+	{
+		allocator.deallocate(block, 1);
+	}
+	for (int ii = 0; ii < 8; ++ii)
+	{
+		blocks[ii % 6] = allocator.allocate(1);
+		allocator.deallocate(blocks[ii % 6], 1);
+	}
+	VERIFY_EQ(allocator.numSlabs(), 2u);
+
+	// a rebound copy shares the arena, so blocks can go back through either one
+	SlabAllocator<std::string> rebound(allocator);
+	VERIFY_TRUE(rebound == allocator);
+	VERIFY_TRUE(SlabAllocator<long long>(rebound) == allocator);
+	VERIFY_TRUE(SlabAllocator<long long>(4) != allocator);
+	std::string* wide = rebound.allocate(1);
+	VERIFY_EQ(allocator.numSlabs(), 3u);
+	long long* big = SlabAllocator<long long>(rebound).allocate(1);
+	allocator.deallocate(big, 1);
+	allocator.release(); // only the block size with nothing out gives its slabs back
+	VERIFY_EQ(allocator.numSlabs(), 1u);
+	rebound.deallocate(wide, 1);
+	allocator.release();
+	VERIFY_EQ(allocator.numSlabs(), 0u);
+
+	typedef MySearchTree<std::string, ThreeWayCompare<std::string>, SlabAllocator<std::string> > SlabTree;
+	SlabTree tree;
+	for (int round = 0; round < 3; ++round)
+	{
+		for (int val = 0; val < 3000; ++val)
+		{
+			VERIFY_TRUE(tree.insert(std::to_string(val * 7919 % 3000)));
+		}
+		VERIFY_EQ(tree.balance(), 1024);
+		for (int val = 0; val < 3000; val += 2)
+		{
+			VERIFY_TRUE(tree.remove(std::to_string(val)));
+		}
+		VERIFY_EQ(tree.rank("1"), 0);
+		VERIFY_EQ(tree.select(tree.rank("1001")), std::string("1001"));
+		SlabTree copy = tree;
+		VERIFY_TRUE(copy.contains("2999"));
+		tree.clear();
+		VERIFY_TRUE(tree.begin() == tree.end());
+		VERIFY_EQ(copy.select(0), std::string("1"));
+	}
+
+	// trees sharing an arena clear, balance and shrink without waiting on each other
+	SlabAllocator<int> sharedArena;
+	MySearchTree<int, ThreeWayCompare<int>, SlabAllocator<int> > first(ThreeWayCompare<int>(), sharedArena);
+	MySearchTree<int, ThreeWayCompare<int>, SlabAllocator<int> > second(ThreeWayCompare<int>(), sharedArena);
+	second.setAutoBalance(0.75);
+	for (int val = 0; val < 100; ++val)
+	{
+		first.insert(val * 37 % 100);
+		second.insert(val);
+	}
+	first.balance();
+	VERIFY_EQ(first.rank(99), 99);
+	first.clear();
+	VERIFY_TRUE(first.begin() == first.end());
+	second.shrink_to_fit();
+	first.shrink_to_fit();
+	VERIFY_EQ(second.rank(99), 99);
+	second.clear();
+	VERIFY_EQ(sharedArena.numSlabs(), 0u);
+	return true;
+}
+
+// round trip through a file, including pages far enough down to be stored sparsely
+bool TreeTests::mappedImage()
+{
+	std::string path = "/tmp/vectorizedtree_image_test";
+	MySearchTree<long long> tree;
+	std::srand(9);
+	for (int ii = 0; ii < 5000; ++ii)
+	{
+		tree.insert(std::rand() % 20000);
+	}
+	for (long long val = 100000; val < 100040; ++val)
+	{
+		tree.insert(val); // a long right spine
+	}
+	tree.save(path);
+
+	MappedSearchTree<long long> mapped = MySearchTree<long long>::open_mapped(path);
+	VERIFY_EQ(mapped.size(), tree.size(tree.getRoot()->getVal()));
+	for (long long val = -5; val < 100045; val += (val < 20005) ? 1 : 3)
+	{
+		VERIFY_EQ(mapped.contains(val), tree.contains(val));
+		VERIFY_EQ(mapped.rank(val), tree.rank(val));
+		MySearchTree<long long>::const_iterator expected = tree.lower_bound(val);
+		const long long* found = mapped.lower_bound(val);
+		VERIFY_EQ(found == nullptr, expected == tree.end());
+		if (found != nullptr)
+		{
+			VERIFY_EQ(*found, *expected);
+		}
+	}
+	VERIFY_EQ(mapped.count_between(100, 19000), tree.count_between(100, 19000));
+	VERIFY_EQ(mapped.select(mapped.size() - 1), 100039);
+
+	// the mapping outlives changes to the file's path
+	MySearchTree<long long>().save(path);
+	VERIFY_TRUE(mapped.contains(100039));
+	MappedSearchTree<long long> empty = MySearchTree<long long>::open_mapped(path);
+	VERIFY_EQ(empty.size(), 0);
+	VERIFY_FALSE(empty.contains(1));
+
+	// images only open as the key type they were written for
+	bool thrown = false;
+	try
+	{
+		MySearchTree<int>::open_mapped(path);
+	}
+	catch (const std::runtime_error&)
+	{
+		thrown = true;
+	}
+	VERIFY_TRUE(thrown);
+
+	// a dense index entry pointing past the pages is rejected instead of read through
+	tree.save(path);
+	MappedHeader header;
+	std::FILE* file = std::fopen(path.c_str(), "r+b");
+	VERIFY_EQ(std::fread(&header, sizeof(header), 1, file), 1u);
+	VERIFY_TRUE(header.m_numDense > 0);
+	std::uint32_t badPosition = static_cast<std::uint32_t>(header.m_numPages) + 5;
+	std::fseek(file, static_cast<long>(header.m_denseOffset), SEEK_SET);
+	std::fwrite(&badPosition, sizeof(badPosition), 1, file);
+	std::fclose(file);
+	thrown = false;
+	try
+	{
+		MySearchTree<long long>::open_mapped(path);
+	}
+	catch (const std::runtime_error&)
+	{
+		thrown = true;
+	}
+	VERIFY_TRUE(thrown);
+
+	// so are header counts so large that the section sizes wrap around, and sections out of order
+	tree.save(path);
+	file = std::fopen(path.c_str(), "rb");
+	VERIFY_EQ(std::fread(&header, sizeof(header), 1, file), 1u);
+	std::fclose(file);
+	std::vector<MappedHeader> corrupt(3, header);
+	corrupt[0].m_numDense = 1ull << 62;
+	corrupt[1].m_numPages = 1ull << 61;
+	corrupt[2].m_denseOffset = header.m_pagesOffset + 8;
+	for (const MappedHeader& bad : corrupt)
+	{
+		file = std::fopen(path.c_str(), "r+b");
+		std::fwrite(&bad, sizeof(bad), 1, file);
+		std::fclose(file);
+		thrown = false;
+		try
+		{
+			MySearchTree<long long>::open_mapped(path);
+		}
+		catch (const std::runtime_error&)
+		{
+			thrown = true;
+		}
+		VERIFY_TRUE(thrown);
+	}
+
+	// subtree sizes that promise more keys than there are make select() throw instead of reading null
+	tree.save(path);
+	header.m_numKeys += 10;
+	file = std::fopen(path.c_str(), "r+b");
+	std::fwrite(&header, sizeof(header), 1, file);
+	std::fclose(file);
+	MappedSearchTree<long long> inflated = MySearchTree<long long>::open_mapped(path);
+	thrown = false;
+	try
+	{
+		inflated.select(inflated.size() - 1);
+	}
+	catch (const std::runtime_error&)
+	{
+		thrown = true;
+	}
+	VERIFY_TRUE(thrown);
+
+	// A sorted spine reaches the deepest slot a tree can fill. Copying its last page one level further
+	// down makes a filled slot whose children would wrap around, which lookups refuse instead of
+	// descending forever
+	MySearchTree<long long> spine;
+	for (long long val = 0; val < 63; ++val)
+	{
+		spine.insert(val);
+	}
+	spine.save(path);
+	file = std::fopen(path.c_str(), "rb");
+	std::vector<char> image(static_cast<std::size_t>(::lseek(::fileno(file), 0, SEEK_END)));
+	std::rewind(file);
+	VERIFY_EQ(std::fread(image.data(), image.size(), 1, file), 1u);
+	std::fclose(file);
+	std::memcpy(&header, image.data(), sizeof(header));
+	MappedHeader deeper = header;
+	deeper.m_numPages += 1;
+	deeper.m_denseOffset += sizeof(std::uint64_t);
+	std::uint64_t denseEnd = deeper.m_denseOffset + header.m_numDense * sizeof(std::uint32_t);
+	deeper.m_pagesOffset = (denseEnd + MAPPED_ALIGNMENT - 1) / MAPPED_ALIGNMENT * MAPPED_ALIGNMENT;
+	std::uint64_t lastPageNum = std::uint64_t(1) << (63 - MAPPED_PAGE_BITS + 1); // holds slot 2^64 - 1
+	--lastPageNum;
+	std::vector<char> grafted(deeper.m_pagesOffset + deeper.m_numPages * sizeof(MappedPage<long long>), 0);
+	std::memcpy(grafted.data(), &deeper, sizeof(deeper));
+	std::memcpy(grafted.data() + deeper.m_directoryOffset, image.data() + header.m_directoryOffset,
+	            header.m_numPages * sizeof(std::uint64_t));
+	std::memcpy(grafted.data() + deeper.m_directoryOffset + header.m_numPages * sizeof(std::uint64_t), &lastPageNum,
+	            sizeof(lastPageNum));
+	std::memcpy(grafted.data() + deeper.m_denseOffset, image.data() + header.m_denseOffset,
+	            header.m_numDense * sizeof(std::uint32_t));
+	std::size_t pagesBytes = header.m_numPages * sizeof(MappedPage<long long>);
+	std::memcpy(grafted.data() + deeper.m_pagesOffset, image.data() + header.m_pagesOffset, pagesBytes);
+	std::memcpy(grafted.data() + deeper.m_pagesOffset + pagesBytes,
+	            image.data() + header.m_pagesOffset + pagesBytes - sizeof(MappedPage<long long>),
+	            sizeof(MappedPage<long long>));
+	file = std::fopen(path.c_str(), "wb");
+	std::fwrite(grafted.data(), grafted.size(), 1, file);
+	std::fclose(file);
+	MappedSearchTree<long long> tooDeep = MySearchTree<long long>::open_mapped(path);
+	thrown = false;
+	try
+	{
+		tooDeep.contains(1000);
+	}
+	catch (const std::runtime_error&)
+	{
+		thrown = true;
+	}
+	VERIFY_TRUE(thrown);
+	VERIFY_TRUE(tooDeep.contains(30));
+
+	std::remove(path.c_str());
+	return true;
+}
+
+bool TreeTests::incrementalCheckpoint()
+{
+	char dirName[] = "/tmp/vectorizedtree_checkpoint_XXXXXX";
+	VERIFY_TRUE(::mkdtemp(dirName) != nullptr);
+	std::string dir = dirName;
+	std::string data = dir + "/pages.1.dat";
+	std::vector<long long> vals;
+	for (long long val = 0; val < 20000; ++val)
+	{
+		vals.push_back(val);
+	}
+	MySearchTree<long long> tree;
+	tree.build_from_sorted(vals.begin(), vals.end());
+	tree.checkpoint(dir);
+	struct stat info;
+	VERIFY_EQ(::stat(data.c_str(), &info), 0);
+	long long fullSize = info.st_size;
+
+	// a couple of changes only append the pages on their paths, a level or so per page
+	tree.remove(5);
+	tree.insert(20001);
+	tree.checkpoint(dir);
+	VERIFY_EQ(::stat(data.c_str(), &info), 0);
+	VERIFY_TRUE(info.st_size > fullSize);
+	VERIFY_TRUE(info.st_size - fullSize <= 12 * static_cast<long long>(sizeof(MappedPage<long long>)));
+	VERIFY_TRUE(info.st_size - fullSize < fullSize / 4);
+
+	MySearchTree<long long> restored;
+	restored.insert(-1);
+	restored.restore(dir);
+	VERIFY_FALSE(restored.contains(-1));
+	VERIFY_FALSE(restored.contains(5));
+	VERIFY_EQ(restored.rank(20001), 19999);
+	VERIFY_TRUE(std::equal(tree.begin(), tree.end(), restored.begin(), restored.end()));
+
+	// the restored tree carries on incrementally from the same checkpoint
+	restored.insert(-1);
+	restored.checkpoint(dir);
+	MySearchTree<long long> again;
+	again.restore(dir);
+	VERIFY_EQ(again.rank(20001), 20000);
+
+	// a flipped byte in a page is caught
+	VERIFY_EQ(::stat(data.c_str(), &info), 0);
+	std::FILE* file = std::fopen(data.c_str(), "r+b");
+	std::fseek(file, info.st_size - 100, SEEK_SET);
+	int byte = std::fgetc(file);
+	std::fseek(file, info.st_size - 100, SEEK_SET);
+	std::fputc(byte ^ 0xFF, file);
+	std::fclose(file);
+	bool thrown = false;
+	try
+	{
+		again.restore(dir);
+	}
+	catch (const std::runtime_error&)
+	{
+		thrown = true;
+	}
+	VERIFY_TRUE(thrown);
+	VERIFY_TRUE(again.begin() == again.end());
+
+	std::remove(data.c_str());
+	std::remove((dir + "/MANIFEST").c_str());
+	::rmdir(dir.c_str());
+	return true;
+}
+
+bool TreeTests::writeAheadLog()
+{
+	char dirName[] = "/tmp/vectorizedtree_log_XXXXXX";
+	VERIFY_TRUE(::mkdtemp(dirName) != nullptr);
+	std::string dir = dirName;
+	std::string path = dir + "/tree.log";
+
+	{
+		MySearchTree<int> tree;
+		VERIFY_EQ(tree.open_log(path), 0u);
+		tree.setAutoBalance(0.75);
+		for (int val = 0; val < 30000; ++val)
+		{
+			tree.insert(val);
+		}
+		for (int val = 0; val < 30000; val += 3)
+		{
+			tree.remove(val);
+		}
+		VERIFY_FALSE(tree.insert(1)); // no change, nothing logged
+		VERIFY_EQ(tree.log_position(), 40000u);
+		tree.sync_log();
+	}
+
+	// recovery replays every change in order
+	MySearchTree<int> replayed;
+	replayed.setAutoBalance(0.75);
+	VERIFY_EQ(replayed.open_log(path), 40000u);
+	VERIFY_EQ(std::distance(replayed.begin(), replayed.end()), 20000);
+	VERIFY_FALSE(replayed.contains(3));
+	VERIFY_EQ(replayed.rank(29999), 19999);
+
+	// a checkpoint empties the log, and restoring it then replaying the log gets back to the latest state
+	replayed.checkpoint(dir + "/checkpoint");
+	replayed.insert(-5);
+	replayed.remove(1);
+	replayed.close_log();
+	MySearchTree<int> recovered;
+	recovered.restore(dir + "/checkpoint");
+	VERIFY_EQ(recovered.open_log(path), 2u);
+	VERIFY_TRUE(std::equal(replayed.begin(), replayed.end(), recovered.begin(), recovered.end()));
+	recovered.close_log();
+
+	// a torn record at the end is cut off and later records follow the good ones
+	std::FILE* file = std::fopen(path.c_str(), "ab");
+	std::fputs("torn", file);
+	std::fclose(file);
+	MySearchTree<int> torn;
+	VERIFY_EQ(torn.open_log(path), 2u);
+	torn.insert(7);
+	torn.close_log();
+	MySearchTree<int> afterTorn;
+	VERIFY_EQ(afterTorn.open_log(path), 3u);
+	VERIFY_TRUE(afterTorn.contains(7));
+	afterTorn.close_log();
+
+	// concurrent writers each return only once their change is durable, sharing fsyncs
+	std::remove(path.c_str());
+	{
+		ConcurrentSearchTree<int> shared;
+		shared.setAutoBalance(0.75);
+		shared.open_log(path);
+		std::vector<std::thread> writers;
+		for (int thread = 0; thread < 4; ++thread)
+		{
+			writers.emplace_back([&shared, thread]()
+			{
+				for (int val = 0; val < 200; ++val)
+				{
+					shared.insert(val * 4 + thread);
+				}
+			});
+		}
+		for (std::thread& writer : writers)
+		{
+			writer.join();
+		}
+	}
+	MySearchTree<int> grouped;
+	grouped.setAutoBalance(0.75);
+	VERIFY_EQ(grouped.open_log(path), 800u);
+	VERIFY_EQ(std::distance(grouped.begin(), grouped.end()), 800);
+	grouped.close_log();
+
+	// writers keep going, and never wait on a log that was closed under them, while it is reopened
+	std::remove(path.c_str());
+	{
+		ConcurrentSearchTree<int> toggled;
+		toggled.setAutoBalance(0.75);
+		toggled.open_log(path);
+		std::vector<std::thread> writers;
+		for (int thread = 0; thread < 3; ++thread)
+		{
+			writers.emplace_back([&toggled, thread]()
+			{
+				for (int val = 0; val < 2000; ++val)
+				{
+					toggled.insert(val * 3 + thread);
+				}
+			});
+		}
+		for (int round = 0; round < 50; ++round)
+		{
+			toggled.close_log();
+			toggled.open_log(path);
+		}
+		for (std::thread& writer : writers)
+		{
+			writer.join();
+		}
+		VERIFY_EQ(toggled.rank(5999), 5999);
+		// the writers may have got every insert in while the log was closed, this one is logged for sure
+		VERIFY_TRUE(toggled.insert(-1));
+		toggled.close_log();
+
+		// only what was inserted while the log was open is in it, but all of that is
+		MySearchTree<int> fromToggled;
+		fromToggled.setAutoBalance(0.75);
+		VERIFY_TRUE(fromToggled.open_log(path) > 0u);
+		VERIFY_TRUE(fromToggled.contains(-1));
+		for (auto it = fromToggled.begin(); it != fromToggled.end(); ++it)
+		{
+			VERIFY_TRUE(toggled.contains(*it));
+		}
+		fromToggled.close_log();
+	}
+
+	// keys of another size are refused
+	bool thrown = false;
+	try
+	{
+		MySearchTree<long long>().open_log(path);
+	}
+	catch (const std::runtime_error&)
+	{
+		thrown = true;
+	}
+	VERIFY_TRUE(thrown);
+
+	// move assignment hands the log over, the moved-from tree stops writing to it
+	std::remove(path.c_str());
+	{
+		MySearchTree<int> source;
+		source.open_log(path);
+		source.insert(1);
+		MySearchTree<int> target;
+		target = std::move(source);
+		VERIFY_EQ(source.log_position(), 0u);
+		VERIFY_TRUE(target.insert(3));
+		VERIFY_EQ(target.log_position(), 2u);
+		target.close_log();
+	}
+	MySearchTree<int> moved;
+	VERIFY_EQ(moved.open_log(path), 2u);
+	moved.close_log();
+
+	// a log that can't be written any more says so, still lets go of its file, and can be opened again
+	std::remove(path.c_str());
+	{
+		MySearchTree<int> failing;
+		failing.setAutoBalance(0.75);
+		failing.open_log(path);
+		struct rlimit limit;
+		VERIFY_EQ(::getrlimit(RLIMIT_FSIZE, &limit), 0);
+		struct rlimit small = limit;
+		small.rlim_cur = 4096;
+		void (*previous)(int) = std::signal(SIGXFSZ, SIG_IGN);
+		::setrlimit(RLIMIT_FSIZE, &small);
+		for (int val = 0; val < 10000; ++val)
+		{
+			failing.insert(val);
+		}
+		bool syncThrown = false;
+		try
+		{
+			failing.sync_log();
+		}
+		catch (const std::runtime_error&)
+		{
+			syncThrown = true;
+		}
+		bool closeThrown = false;
+		try
+		{
+			failing.close_log();
+		}
+		catch (const std::runtime_error&)
+		{
+			closeThrown = true;
+		}
+		::setrlimit(RLIMIT_FSIZE, &limit);
+		std::signal(SIGXFSZ, previous);
+		VERIFY_TRUE(syncThrown);
+		VERIFY_TRUE(closeThrown);
+		VERIFY_EQ(failing.log_position(), 0u);
+
+		VERIFY_TRUE(failing.open_log(path) > 0u); // whatever made it out before the failure
+		VERIFY_TRUE(failing.insert(-1));
+		failing.close_log();
+	}
+	MySearchTree<int> afterFailure;
+	afterFailure.setAutoBalance(0.75);
+	VERIFY_TRUE(afterFailure.open_log(path) > 0u);
+	VERIFY_TRUE(afterFailure.contains(-1));
+	afterFailure.close_log();
+
+	std::remove(path.c_str());
+	std::remove((dir + "/checkpoint/MANIFEST").c_str());
+	std::remove((dir + "/checkpoint/pages.1.dat").c_str());
+	::rmdir((dir + "/checkpoint").c_str());
+	::rmdir(dir.c_str());
+	return true;
+}
+
+bool TreeTests::instrumentation()
+{
+	typedef MySearchTree<int, ThreeWayCompare<int>, std::allocator<int>, CountingStats> CountedTree;
+	CountedTree tree;
+	std::srand(23);
+	int numInserted = 0;
+	for (int ii = 0; ii < 2000; ++ii)
+	{
+		numInserted += tree.insert(std::rand() % 100000);
+	}
+	TreeStats afterInserts = tree.stats();
+	VERIFY_EQ(afterInserts.m_descents, 2000u);
+	VERIFY_TRUE(afterInserts.m_levelsDescended >= afterInserts.m_descents);
+	VERIFY_EQ(afterInserts.m_comparisons, afterInserts.m_levelsDescended); // one compare per level
+	VERIFY_TRUE(afterInserts.m_maxDepth >= 11); // 2000 keys can't fit in fewer levels
+	VERIFY_TRUE(afterInserts.m_pageAllocations > 0);
+	VERIFY_TRUE(afterInserts.m_bytesAllocated >= afterInserts.m_pageAllocations * 512 * (sizeof(int) + sizeof(int)));
+	VERIFY_EQ(afterInserts.m_latency[STAT_INSERT].count(), 2000u / LATENCY_SAMPLE_EVERY);
+	VERIFY_EQ(afterInserts.m_removeSwaps, 0u);
+	VERIFY_EQ(afterInserts.m_balances, 0u);
+
+	int root = tree.getRoot()->getVal();
+	VERIFY_TRUE(tree.contains(root));
+	VERIFY_EQ(tree.stats().m_descents, 2001u);
+	VERIFY_TRUE(tree.remove(root)); // the root has children, so it has to be swapped down
+	VERIFY_TRUE(tree.stats().m_removeSwaps > 0);
+	tree.balance();
+	TreeStats afterBalance = tree.stats();
+	VERIFY_EQ(afterBalance.m_balances, 1u);
+	VERIFY_TRUE(afterBalance.m_balanceNanos > 0);
+	VERIFY_EQ(afterBalance.m_latency[STAT_LOOKUP].count(), 1u);
+	VERIFY_TRUE(afterBalance.m_latency[STAT_INSERT].percentile(0.5) <= afterBalance.m_latency[STAT_INSERT].percentile(1.0));
+
+	// copies keep the history; the default policy counts nothing but allocations
+	CountedTree copy(tree);
+	VERIFY_EQ(copy.stats().m_comparisons, afterBalance.m_comparisons);
+	MySearchTree<int> plain;
+	plain.insert(1);
+	VERIFY_TRUE(plain.contains(1));
+	VERIFY_EQ(plain.stats().m_comparisons, 0u);
+	VERIFY_EQ(plain.stats().m_pageAllocations, 1u);
+
+	// a moved in tree brings its own count instead of adding to the one it replaces
+	MySearchTree<int> target;
+	target.insert(2);
+	target = std::move(plain);
+	VERIFY_EQ(target.stats().m_pageAllocations, 1u);
+	return true;
+}
+
+bool TreeTests::shrinkAfterDeletes()
+{
+	typedef MySearchTree<int, ThreeWayCompare<int>, std::allocator<int>, CountingStats> CountedTree;
+	CountedTree tree;
+	std::vector<int> keys;
+	std::srand(24);
+	for (int ii = 0; ii < 20000; ++ii)
+	{
+		int key = std::rand() % 1000000;
+		if (tree.insert(key))
+		{
+			keys.push_back(key);
+		}
+	}
+	MemoryUsage full = tree.memory_usage();
+	VERIFY_EQ(full.m_occupied, keys.size());
+	VERIFY_EQ(full.m_slots, full.m_pages * 512);
+	VERIFY_TRUE(full.m_bytes >= full.m_pages * 512 * (sizeof(int) + sizeof(int)));
+
+	// expire all but every 16th key. The survivors are left scattered over a lot of deep pages
+	std::size_t numLeft = 0;
+	for (std::size_t ii = 0; ii < keys.size(); ++ii)
+	{
+		if (ii % 16 != 0)
+		{
+			VERIFY_TRUE(tree.remove(keys[ii]));
+		}
+		else
+		{
+			++numLeft;
+		}
+	}
+	MemoryUsage sparse = tree.memory_usage();
+	VERIFY_EQ(sparse.m_occupied, numLeft);
+	VERIFY_TRUE(sparse.m_pages > 20);
+
+	tree.shrink_to_fit();
+	MemoryUsage tight = tree.memory_usage();
+	VERIFY_EQ(tight.m_occupied, numLeft);
+	VERIFY_TRUE(tight.m_pages <= 4); // about 1250 keys fill the slots up to 2047
+	VERIFY_TRUE(tight.m_bytes < sparse.m_bytes / 10);
+	VERIFY_EQ(static_cast<std::size_t>(std::distance(tree.begin(), tree.end())), numLeft);
+	VERIFY_TRUE(tree.contains(keys[16]));
+	VERIFY_FALSE(tree.contains(keys[1]));
+
+	// the same expiry with auto compaction keeps the pages from getting much emptier than the threshold,
+	// with only a handful of rebuilds
+	CountedTree autoTree;
+	autoTree.setAutoCompact(0.25);
+	for (int key : keys)
+	{
+		autoTree.insert(key);
+	}
+	for (std::size_t ii = 0; ii < keys.size(); ++ii)
+	{
+		if (ii % 16 != 0)
+		{
+			VERIFY_TRUE(autoTree.remove(keys[ii]));
+		}
+	}
+	MemoryUsage compacted = autoTree.memory_usage();
+	VERIFY_EQ(compacted.m_occupied, numLeft);
+	VERIFY_TRUE(compacted.m_occupied * 4 >= compacted.m_slots || compacted.m_pages <= 4);
+	VERIFY_TRUE(autoTree.stats().m_balances > 0);
+	VERIFY_TRUE(autoTree.stats().m_balances < 20);
+	VERIFY_TRUE(autoTree.contains(keys[16]));
+
+	// emptying the tree gives everything back
+	for (std::size_t ii = 0; ii < keys.size(); ii += 16)
+	{
+		VERIFY_TRUE(autoTree.remove(keys[ii]));
+	}
+	autoTree.shrink_to_fit();
+	VERIFY_EQ(autoTree.memory_usage().m_pages, 0u);
+	VERIFY_EQ(autoTree.memory_usage().m_slots, 0u);
+	VERIFY_TRUE(autoTree.memory_usage().m_bytes < 64); // at most an empty hash table
+
+	bool threw = false;
+	try
+	{
+		autoTree.setAutoCompact(0.75);
+	}
+	catch (const std::invalid_argument&)
+	{
+		threw = true;
+	}
+	VERIFY_TRUE(threw);
+	return true;
+}
+
+bool TreeTests::multiset()
+{
+	MultiSearchTree<int> tree;
+	tree.setAutoBalance(0.75);
+	// key k is inserted k % 5 + 1 times
+	int total = 0;
+	for (int rep = 0; rep < 5; ++rep)
+	{
+		for (int key = 0; key < 2000; ++key)
+		{
+			if (key % 5 >= rep)
+			{
+				VERIFY_TRUE(tree.insert(key));
+				++total;
+			}
+		}
+	}
+	VERIFY_EQ(tree.count(7), 3);
+	VERIFY_EQ(tree.count(5000), 0);
+	VERIFY_EQ(tree.size(tree.getRoot()->getVal()), total);
+	VERIFY_EQ(std::distance(tree.begin(), tree.end()), 2000); // iteration visits each key once
+
+	// 0..9 are there 1, 2, 3, 4, 5, 1, 2, 3, 4, 5 times
+	VERIFY_EQ(tree.rank(0), 0);
+	VERIFY_EQ(tree.rank(1), 1);
+	VERIFY_EQ(tree.rank(5), 15);
+	VERIFY_EQ(tree.rank(10), 30);
+	VERIFY_EQ(tree.select(0), 0);
+	VERIFY_EQ(tree.select(1), 1);
+	VERIFY_EQ(tree.select(2), 1);
+	VERIFY_EQ(tree.select(14), 4);
+	VERIFY_EQ(tree.select(15), 5);
+	VERIFY_EQ(tree.select(total - 1), 1999);
+	VERIFY_EQ(tree.count_between(1, 3), 9);
+	int keys[3] = {2, 10, 4000};
+	int ranks[3];
+	tree.rank_batch(keys, 3, ranks);
+	VERIFY_EQ(ranks[0], 3);
+	VERIFY_EQ(ranks[1], 30);
+	VERIFY_EQ(ranks[2], 0);
+
+	// removes take one occurrence at a time, and the key goes once none are left
+	VERIFY_TRUE(tree.remove(4));
+	VERIFY_EQ(tree.count(4), 4);
+	VERIFY_EQ(tree.rank(5), 14);
+	for (int ii = 0; ii < 4; ++ii)
+	{
+		VERIFY_TRUE(tree.remove(4));
+	}
+	VERIFY_FALSE(tree.contains(4));
+	VERIFY_FALSE(tree.remove(4));
+	VERIFY_EQ(tree.rank(5), 10);
+	int out = 0;
+	VERIFY_TRUE(tree.extract(9, out));
+	VERIFY_EQ(out, 9);
+	VERIFY_EQ(tree.count(9), 4);
+	total -= 6;
+
+	// removing keys with children swaps counted keys around; the sizes have to follow them
+	for (int key = 0; key < 2000; key += 7)
+	{
+		while (tree.remove(key))
+		{
+			--total;
+		}
+	}
+	VERIFY_EQ(tree.size(tree.getRoot()->getVal()), total);
+	int seen = 0;
+	for (MultiSearchTree<int>::const_iterator it = tree.begin(); it != tree.end(); ++it)
+	{
+		VERIFY_EQ(tree.rank(*it), seen);
+		VERIFY_EQ(tree.select(seen), *it);
+		seen += tree.count(*it);
+	}
+	VERIFY_EQ(seen, total);
+
+	// rebuilds carry the counts along
+	MultiSearchTree<int> copy(tree);
+	tree.balance();
+	VERIFY_EQ(tree.count(8), 4);
+	VERIFY_EQ(tree.rank(1999), total - 5);
+	WorkStealingPool pool(4);
+	copy.balance(pool);
+	VERIFY_TRUE(std::equal(tree.begin(), tree.end(), copy.begin(), copy.end()));
+	VERIFY_EQ(copy.count(8), 4);
+	VERIFY_EQ(copy.select(total - 1), 1999);
+
+	// big enough for the parallel rebuild to split its work
+	MultiSearchTree<int> big;
+	std::srand(25);
+	for (int ii = 0; ii < 60000; ++ii)
+	{
+		big.insert(std::rand() % 30000);
+	}
+	MultiSearchTree<int> bigCopy(big);
+	VERIFY_EQ(bigCopy.balance(pool), big.balance());
+	VERIFY_TRUE(std::equal(big.begin(), big.end(), bigCopy.begin(), bigCopy.end()));
+	for (int key = 0; key < 30000; key += 97)
+	{
+		VERIFY_EQ(bigCopy.count(key), big.count(key));
+		VERIFY_EQ(bigCopy.rank(key), big.rank(key));
+	}
+	VERIFY_EQ(bigCopy.size(bigCopy.getRoot()->getVal()), 60000);
+
+	// runs of equal keys become one node each
+	std::vector<int> sorted = {1, 1, 1, 2, 5, 5};
+	MultiSearchTree<int> built(sorted.begin(), sorted.end());
+	VERIFY_EQ(std::distance(built.begin(), built.end()), 3);
+	VERIFY_EQ(built.count(1), 3);
+	VERIFY_EQ(built.rank(5), 4);
+
+	// log records hold absolute counts, so replaying one that is already in a checkpoint is harmless
+	char dirName[] = "/tmp/vectorizedtree_multiset_XXXXXX";
+	VERIFY_TRUE(::mkdtemp(dirName) != nullptr);
+	std::string dir = dirName;
+	std::string path = dir + "/tree.log";
+	{
+		MultiSearchTree<int> logged;
+		logged.open_log(path);
+		for (int ii = 0; ii < 3; ++ii)
+		{
+			logged.insert(10);
+			logged.insert(20);
+		}
+		logged.remove(20);
+		logged.checkpoint(dir + "/checkpoint"); // empties the log
+		logged.insert(10);
+		logged.close_log();
+	}
+	MultiSearchTree<int> recovered;
+	recovered.restore(dir + "/checkpoint");
+	VERIFY_EQ(recovered.count(10), 3);
+	VERIFY_EQ(recovered.count(20), 2);
+	VERIFY_EQ(recovered.open_log(path), 1u);
+	recovered.close_log();
+	VERIFY_EQ(recovered.open_log(path), 1u); // the same record again
+	VERIFY_EQ(recovered.count(10), 4);
+	VERIFY_EQ(recovered.rank(20), 4);
+	recovered.close_log();
+	return true;
+}
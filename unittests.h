@@ -24,6 +24,28 @@ protected:
         ADD_TEST(TreeTests::sevenElementBalance);
         ADD_TEST(TreeTests::rankTest);
         ADD_TEST(TreeTests::sizeTest);
+        ADD_TEST(TreeTests::stringKeys);
+        ADD_TEST(TreeTests::freezeTest);
+        ADD_TEST(TreeTests::sizeAfterRemove);
+        ADD_TEST(TreeTests::sortedInsert);
+        ADD_TEST(TreeTests::autoBalance);
+        ADD_TEST(TreeTests::buildFromSorted);
+        ADD_TEST(TreeTests::batchLookup);
+        ADD_TEST(TreeTests::freezeBatchLookup);
+        ADD_TEST(TreeTests::comparatorPolicy);
+        ADD_TEST(TreeTests::concurrentReads);
+        ADD_TEST(TreeTests::versionedReads);
+        ADD_TEST(TreeTests::parallelBalance);
+        ADD_TEST(TreeTests::iterators);
+        ADD_TEST(TreeTests::orderStatistics);
+        ADD_TEST(TreeTests::moveOnlyKeys);
+        ADD_TEST(TreeTests::slabAllocator);
+        ADD_TEST(TreeTests::mappedImage);
+        ADD_TEST(TreeTests::incrementalCheckpoint);
+        ADD_TEST(TreeTests::writeAheadLog);
+        ADD_TEST(TreeTests::instrumentation);
+        ADD_TEST(TreeTests::shrinkAfterDeletes);
+        ADD_TEST(TreeTests::multiset);
     }
 
 private:
@@ -43,6 +65,28 @@ private:
 	static bool sevenElementBalance(); // height 3
     static bool rankTest();
     static bool sizeTest();
+    static bool stringKeys(); // non-trivial keys stored inline
+    static bool freezeTest();
+    static bool sizeAfterRemove(); // subtree counts follow remove() and balance()
+    static bool sortedInsert(); // worst case depth, only possible with paged storage
+    static bool autoBalance();
+    static bool buildFromSorted();
+    static bool batchLookup();
+    static bool freezeBatchLookup(); // SIMD kernels when the CPU has them
+    static bool comparatorPolicy(); // bool, three-way and runtime comparators
+    static bool concurrentReads();
+    static bool versionedReads(); // lookups keep going while balance() runs
+    static bool parallelBalance(); // same shape as the serial balance()
+    static bool iterators();
+    static bool orderStatistics(); // select and count_between
+    static bool moveOnlyKeys(); // insert(T&&), emplace and extract
+    static bool slabAllocator();
+    static bool mappedImage(); // save() and open_mapped()
+    static bool incrementalCheckpoint(); // checkpoint() and restore()
+    static bool writeAheadLog(); // replay, torn tails and group commit
+    static bool instrumentation(); // CountingStats policy and stats()
+    static bool shrinkAfterDeletes(); // shrink_to_fit, setAutoCompact and memory_usage
+    static bool multiset(); // CountedKeys policy (MultiSearchTree)
 
     static Test_Registrar<TreeTests> registrar;
 };
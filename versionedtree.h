@@ -0,0 +1,245 @@
+// VERSIONED SEARCH TREE
+// -Concurrent mode where readers never wait on writers, RCU style
+// -The current contents are an immutable MySearchTree published through an atomic raw pointer. A
+//      reader pins the current epoch in a reader slot of its own, loads the pointer and runs its lookup
+//      on whatever version it got; nothing can change under it, so there is no lock around the lookup
+//      and no reference count that every reader has to bump
+// -Writers are serialized among themselves. Each one copies the current version, applies its change
+//      to the private copy (this is where balance() runs) and then publishes the copy with one atomic
+//      store. Readers that started before the store finish on the old version
+// -The replaced version is retired with the epoch it was replaced in and freed by a later write once
+//      no reader slot is pinned at that epoch or earlier, so writers never wait on readers either
+// -Reader slots are claimed with a single compare and swap and sit on their own cache lines. Only
+//      more than MAX_READERS lookups and snapshots at once have to wait for a slot to free up
+// -Every write pays for a full copy of the tree, so group changes with update() where possible
+//
+// Functions
+//    1) snapshot (pins the current version)
+//    2) contains / rank / size / contains_batch / rank_batch
+//    3) update (applies any number of changes as one new version)
+//    4) insert / remove / balance / setAutoBalance
+#ifndef __VERSIONED_TREE__
+#define __VERSIONED_TREE__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "tree.h"
+
+template<typename T, typename Compare = ThreeWayCompare<T> >
+class VersionedSearchTree
+{
+public:
+    typedef MySearchTree<T, Compare> Tree;
+
+    // lookups and snapshots that can be in progress at once without waiting for a reader slot
+    static const std::size_t MAX_READERS = 128;
+
+    // A pinned version. It stays valid and unchanged for as long as the Snapshot lives, which must not
+    // be longer than the VersionedSearchTree. Holding one keeps every later replaced version from being
+    // freed, so don't keep it around for longer than needed
+    class Snapshot
+    {
+    public:
+        Snapshot(Snapshot&& other): m_slot(other.m_slot), m_tree(other.m_tree)
+        {
+            other.m_slot = nullptr;
+        }
+
+        ~Snapshot()
+        {
+            if (m_slot != nullptr)
+            {
+                m_slot->store(0, std::memory_order_release);
+            }
+        }
+
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        Snapshot& operator=(Snapshot&&) = delete;
+
+        const Tree& operator*() const { return *m_tree; }
+        const Tree* operator->() const { return m_tree; }
+
+    private:
+        friend class VersionedSearchTree;
+        Snapshot(std::atomic<std::uint64_t>* slot, const Tree* tree): m_slot(slot), m_tree(tree) {}
+
+        std::atomic<std::uint64_t>* m_slot; // nullptr once moved from
+        const Tree* m_tree;
+    };
+
+    VersionedSearchTree(const Compare& comparator = Compare())
+        : m_current(new Tree(comparator)), m_epoch(1)
+    {
+        for (ReaderSlot& slot : m_readers)
+        {
+            slot.m_epoch.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // no reader may still be using the tree
+    ~VersionedSearchTree()
+    {
+        delete m_current.load(std::memory_order_relaxed);
+        for (const Retired& retired : m_retired)
+        {
+            delete retired.first;
+        }
+    }
+
+    VersionedSearchTree(const VersionedSearchTree&) = delete;
+    VersionedSearchTree& operator=(const VersionedSearchTree&) = delete;
+
+    // the version that is current right now
+    Snapshot snapshot() const
+    {
+        std::atomic<std::uint64_t>* slot = pin();
+        return Snapshot(slot, m_current.load(std::memory_order_seq_cst));
+    }
+
+    bool contains(const T& value) const
+    {
+        return snapshot()->contains(value);
+    }
+
+    int rank(const T& value) const
+    {
+        return snapshot()->rank(value);
+    }
+
+    int size(const T& value) const
+    {
+        return snapshot()->size(value);
+    }
+
+    void contains_batch(const T* keys, std::size_t count, bool* out) const
+    {
+        snapshot()->contains_batch(keys, count, out);
+    }
+
+    void rank_batch(const T* keys, std::size_t count, int* out) const
+    {
+        snapshot()->rank_batch(keys, count, out);
+    }
+
+    // Calls change(tree) on a private copy of the current version and publishes the result. Readers
+    // see either none or all of the changes made by one call
+    template<typename Function>
+    void update(Function change)
+    {
+        std::lock_guard<std::mutex> lock(m_writeMutex);
+        const Tree* current = m_current.load(std::memory_order_relaxed);
+        std::unique_ptr<Tree> next(new Tree(*current));
+        change(*next);
+
+        m_current.store(next.release(), std::memory_order_seq_cst);
+        m_retired.push_back(Retired(current, m_epoch.fetch_add(1, std::memory_order_seq_cst)));
+        reclaim();
+    }
+
+    bool insert(const T& value)
+    {
+        bool inserted = false;
+        update([&](Tree& tree) { inserted = tree.insert(value); });
+        return inserted;
+    }
+
+    bool remove(const T& value)
+    {
+        bool removed = false;
+        update([&](Tree& tree) { removed = tree.remove(value); });
+        return removed;
+    }
+
+    int balance()
+    {
+        int numBarren = 0;
+        update([&](Tree& tree) { numBarren = tree.balance(); });
+        return numBarren;
+    }
+
+    void setAutoBalance(double alpha)
+    {
+        update([&](Tree& tree) { tree.setAutoBalance(alpha); });
+    }
+
+private:
+    // the epoch a reader pinned, 0 while the slot is free. Padded out to a cache line so readers on
+    // different cores don't write to the same one
+    struct ReaderSlot
+    {
+        std::atomic<std::uint64_t> m_epoch;
+        char m_padding[64 - sizeof(std::atomic<std::uint64_t>)];
+    };
+
+    // a replaced version and the epoch it was replaced in
+    typedef std::pair<const Tree*, std::uint64_t> Retired;
+
+    std::atomic<const Tree*> m_current;
+    std::atomic<std::uint64_t> m_epoch; // bumped by every publish
+    mutable ReaderSlot m_readers[MAX_READERS];
+    std::vector<Retired> m_retired; // only touched by writers, under m_writeMutex
+    std::mutex m_writeMutex;
+
+    // Claims a free reader slot and pins the current epoch in it. Threads are handed out starting spots
+    // round robin, so readers on different threads normally succeed on their first try. The store into
+    // the slot is ordered before the caller's load of m_current, which is what reclaim() relies on
+    std::atomic<std::uint64_t>* pin() const
+    {
+        static std::atomic<std::size_t> nextStart(0);
+        thread_local std::size_t start = nextStart.fetch_add(1, std::memory_order_relaxed);
+        while (true)
+        {
+            std::uint64_t epoch = m_epoch.load(std::memory_order_seq_cst);
+            for (std::size_t ii = 0; ii < MAX_READERS; ++ii)
+            {
+                std::atomic<std::uint64_t>& slot = m_readers[(start + ii) % MAX_READERS].m_epoch;
+                std::uint64_t expected = 0;
+                if (slot.load(std::memory_order_relaxed) == 0 &&
+                    slot.compare_exchange_strong(expected, epoch, std::memory_order_seq_cst))
+                {
+                    return &slot;
+                }
+            }
+            std::this_thread::yield(); // every slot is in use
+        }
+    }
+
+    // Frees the retired versions no reader can still be on. A version replaced in epoch e was unpublished
+    // before the epoch moved past e, so a reader pinned at a later epoch loaded a newer pointer. Only
+    // readers pinned at e or earlier might hold it
+    void reclaim()
+    {
+        std::uint64_t oldestPinned = UINT64_MAX;
+        for (const ReaderSlot& slot : m_readers)
+        {
+            std::uint64_t epoch = slot.m_epoch.load(std::memory_order_seq_cst);
+            if (epoch != 0 && epoch < oldestPinned)
+            {
+                oldestPinned = epoch;
+            }
+        }
+
+        std::size_t kept = 0;
+        for (const Retired& retired : m_retired)
+        {
+            if (retired.second < oldestPinned)
+            {
+                delete retired.first;
+            }
+            else
+            {
+                m_retired[kept++] = retired;
+            }
+        }
+        m_retired.resize(kept);
+    }
+};
+
+#endif
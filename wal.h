@@ -0,0 +1,432 @@
+// WRITE-AHEAD LOG
+// -Durability for MySearchTree between checkpoints, used through MySearchTree::open_log()
+// -Every insert, remove and clear that changes the tree appends a small record: the operation, the key
+//      and a CRC-32 of both. Appending only copies the record into a memory buffer, so ingest runs at
+//      close to in-memory speed. The buffer goes to the file when it fills up or on sync()
+// -A change is durable once sync() has returned for its position. sync() is a group commit: the first
+//      caller that finds its records not yet synced becomes the leader, writes everything buffered so
+//      far and issues one fdatasync for the whole batch. Callers arriving meanwhile wait for that one
+//      or lead the next, so concurrent writers share fsyncs instead of paying one each
+// -open() replays the records already in the file, in order, so recovery costs time proportional to
+//      the log length. A torn or corrupt tail (a crash in the middle of a write) ends the replay and
+//      is cut off, so later records follow the last good one
+// -Replaying a record that is already reflected in the tree is harmless: the last insert or remove of
+//      a key decides whether it is present. That is what makes it safe to empty the log right after a
+//      checkpoint commits (truncate), even if the process dies in between. A multiset tree logs each
+//      key with its count after the change, which keeps the same property (see multiplicity.h)
+// -Only trivially copyable keys can be logged, since they are written as raw bytes
+//
+// Functions
+//    1) open / close
+//    2) append / position
+//    3) sync (group commit)
+//    4) truncate
+#ifndef __WRITE_AHEAD_LOG__
+#define __WRITE_AHEAD_LOG__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+
+static const std::uint32_t LOG_VERSION = 1;
+static const char LOG_MAGIC[8] = {'V', 'T', 'R', 'E', 'E', 'W', 'A', 'L'};
+// buffered records are handed to the OS once they reach this many bytes, even without a sync()
+static const std::size_t LOG_BUFFER_BYTES = 1 << 16;
+
+enum LogOp
+{
+    LOG_INSERT = 1,
+    LOG_REMOVE = 2,
+    LOG_CLEAR = 3
+};
+
+struct LogHeader
+{
+    char m_magic[8];
+    std::uint32_t m_version;
+    std::uint32_t m_endianCheck;
+    std::uint32_t m_keySize;
+    std::uint32_t m_keyAlign;
+};
+
+template<typename T>
+struct LogRecord
+{
+    std::uint32_t m_checksum; // of everything after it
+    std::uint32_t m_op;
+    T m_key;
+};
+
+template<typename T>
+class WriteAheadLog
+{
+public:
+    WriteAheadLog(): m_fd(-1), m_appended(0), m_durable(0), m_syncing(false), m_failed(false) {}
+
+    // a copy of a tree doesn't write to its original's log
+    WriteAheadLog(const WriteAheadLog&): m_fd(-1), m_appended(0), m_durable(0), m_syncing(false), m_failed(false) {}
+
+    // the log moves along with its tree. Nobody else may be using other at the time
+    WriteAheadLog(WriteAheadLog&& other)
+        : m_fd(other.m_fd.load()), m_buffer(std::move(other.m_buffer)), m_appended(other.m_appended),
+          m_durable(other.m_durable), m_syncing(false), m_failed(other.m_failed)
+    {
+        other.m_fd = -1;
+        other.m_appended = 0;
+        other.m_durable = 0;
+    }
+
+    // a tree that is assigned over stops logging, its old log no longer describes it
+    WriteAheadLog& operator=(const WriteAheadLog&)
+    {
+        closeFile(false);
+        return *this;
+    }
+
+    // takes over other's log, like the move constructor, after closing this one
+    WriteAheadLog& operator=(WriteAheadLog&& other)
+    {
+        if (this != &other)
+        {
+            closeFile(false);
+            m_fd.store(other.m_fd.load());
+            m_buffer = std::move(other.m_buffer);
+            m_appended = other.m_appended;
+            m_durable = other.m_durable;
+            m_failed = other.m_failed;
+            other.m_fd = -1;
+            other.m_buffer.clear();
+            other.m_appended = 0;
+            other.m_durable = 0;
+        }
+        return *this;
+    }
+
+    ~WriteAheadLog()
+    {
+        if (m_fd >= 0 && !m_failed)
+        {
+            // best effort, a destructor can't report a failure
+            writeAll(m_buffer.data(), m_buffer.size());
+            ::fdatasync(m_fd);
+        }
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+        }
+    }
+
+    // may be called while another thread opens or closes the log, though the answer can be stale by
+    // the time it returns
+    bool isOpen() const
+    {
+        return m_fd.load(std::memory_order_acquire) >= 0;
+    }
+
+    // Opens the log at path, creating it if needed, after calling apply(op, key) for every record in
+    // it. Returns the number of records replayed. Throws std::runtime_error if the file can't be opened
+    // or was written for a different key type. Positions keep counting from where the last log left off,
+    // so a position taken before a close() and reopen is still synced, by the close(). A log that failed
+    // is closed without another attempt to write it, so opening one again is how to recover
+    template<typename Apply>
+    std::size_t open(const std::string& path, Apply apply)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "The log writes keys as raw bytes, T must be trivially copyable");
+
+        closeFile(false);
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd < 0)
+        {
+            throw std::runtime_error( "Cannot open log " + path );
+        }
+
+        std::size_t numReplayed = 0;
+        try
+        {
+            numReplayed = replay(fd, path, apply);
+        }
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fd.store(fd, std::memory_order_release);
+        m_buffer.clear();
+        m_durable = m_appended;
+        m_failed = false;
+        return numReplayed;
+    }
+
+    // syncs everything appended so far and closes the file. The file is closed even when that fails,
+    // and then std::runtime_error is thrown, as it is for a log that had already failed
+    void close()
+    {
+        closeFile(true);
+    }
+
+    // adds a record and returns its position, for sync(). key is nullptr for LOG_CLEAR
+    std::uint64_t append(LogOp op, const T* key)
+    {
+        LogRecord<T> record;
+        std::memset(&record, 0, sizeof(record));
+        record.m_op = op;
+        if (key != nullptr)
+        {
+            std::memcpy(&record.m_key, key, sizeof(T));
+        }
+        record.m_checksum = checksum32(&record.m_op, sizeof(record) - sizeof(record.m_checksum));
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // once a write has failed nothing reaches the file any more, and every sync() reports it, so
+        // the record is dropped rather than kept around
+        if (m_failed)
+        {
+            return ++m_appended;
+        }
+        const char* bytes = reinterpret_cast<const char*>(&record);
+        m_buffer.insert(m_buffer.end(), bytes, bytes + sizeof(record));
+        // a running sync() owns the file until it is done, the next one picks these up
+        if (m_buffer.size() >= LOG_BUFFER_BYTES && !m_syncing)
+        {
+            m_failed = !writeAll(m_buffer.data(), m_buffer.size());
+            m_buffer.clear();
+        }
+        return ++m_appended;
+    }
+
+    // position of the last record appended, 0 if there is none
+    std::uint64_t position() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_appended;
+    }
+
+    // Returns once every record up to and including position is on disk. Safe to call from any number
+    // of threads at once, which is how commits get grouped. Throws std::runtime_error if the log
+    // couldn't be written; every later sync() throws as well. Returns right away once the log is closed,
+    // since close() synced everything appended before it
+    void sync(std::uint64_t position)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_durable < position)
+        {
+            if (m_failed)
+            {
+                throw std::runtime_error( "Failed to write log" );
+            }
+            if (m_fd < 0)
+            {
+                return;
+            }
+            if (m_syncing)
+            {
+                m_synced.wait(lock);
+                continue;
+            }
+
+            // lead a group commit of everything appended up to now
+            m_syncing = true;
+            std::vector<char> batch;
+            batch.swap(m_buffer);
+            m_buffer.swap(m_spare);
+            std::uint64_t target = m_appended;
+            int fd = m_fd;
+            lock.unlock();
+
+            bool written = writeAll(fd, batch.data(), batch.size()) && ::fdatasync(fd) == 0;
+
+            lock.lock();
+            m_syncing = false;
+            batch.clear();
+            m_spare.swap(batch);
+            if (written)
+            {
+                m_durable = target;
+            }
+            else
+            {
+                m_failed = true;
+            }
+            m_synced.notify_all();
+        }
+    }
+
+    // Empties the log. Only call this once everything in it is safe elsewhere, ie. after a checkpoint
+    // that includes every appended record has committed
+    void truncate()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_synced.wait(lock, [this]() { return !m_syncing; });
+        m_buffer.clear();
+        if (::ftruncate(m_fd, sizeof(LogHeader)) != 0 || ::fdatasync(m_fd) != 0)
+        {
+            m_failed = true;
+            throw std::runtime_error( "Failed to truncate log" );
+        }
+        m_durable = m_appended;
+    }
+
+private:
+    std::atomic<int> m_fd; // only changed under m_mutex, atomic so isOpen() can skip it
+    std::vector<char> m_buffer; // records not handed to the OS yet
+    std::vector<char> m_spare; // the last batch's buffer, kept for its capacity
+    std::uint64_t m_appended;
+    std::uint64_t m_durable; // every record up to here has been synced
+    bool m_syncing; // a leader is writing a batch
+    bool m_failed;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_synced;
+
+    // Writes out what is still buffered and closes the file, which is released even if the write fails.
+    // The last write happens under the same lock as the close, so nothing appended can fall in between.
+    // A log that failed earlier is closed without writing; reportFailed says whether that throws too
+    void closeFile(bool reportFailed)
+    {
+        if (m_fd < 0)
+        {
+            return;
+        }
+
+        // a running leader still owns the file
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_synced.wait(lock, [this]() { return !m_syncing; });
+        bool failedBefore = m_failed;
+        if (!m_failed)
+        {
+            if (writeAll(m_buffer.data(), m_buffer.size()) && ::fdatasync(m_fd) == 0)
+            {
+                m_durable = m_appended;
+            }
+            else
+            {
+                m_failed = true;
+            }
+        }
+        m_buffer.clear();
+        ::close(m_fd);
+        m_fd.store(-1, std::memory_order_release);
+        m_synced.notify_all();
+
+        if (m_failed && (reportFailed || !failedBefore))
+        {
+            throw std::runtime_error( "Failed to write log" );
+        }
+    }
+
+    static LogHeader makeHeader()
+    {
+        LogHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.m_magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+        header.m_version = LOG_VERSION;
+        header.m_endianCheck = MAPPED_ENDIAN_CHECK;
+        header.m_keySize = sizeof(T);
+        header.m_keyAlign = alignof(T);
+        return header;
+    }
+
+    // applies every good record in fd and cuts off anything after the last one
+    template<typename Apply>
+    static std::size_t replay(int fd, const std::string& path, Apply& apply)
+    {
+        LogHeader expected = makeHeader();
+        LogHeader header;
+        ssize_t got = ::pread(fd, &header, sizeof(header), 0);
+        if (got < static_cast<ssize_t>(sizeof(header)))
+        {
+            // new, or so short that nothing was ever logged to it
+            if (::ftruncate(fd, 0) != 0 || ::write(fd, &expected, sizeof(expected)) != sizeof(expected) ||
+                ::fdatasync(fd) != 0)
+            {
+                throw std::runtime_error( "Cannot initialize log " + path );
+            }
+            return 0;
+        }
+        if (std::memcmp(&header, &expected, sizeof(header)) != 0)
+        {
+            throw std::runtime_error( "Log was written for a different key type or format: " + path );
+        }
+
+        std::size_t numReplayed = 0;
+        std::uint64_t offset = sizeof(header);
+        std::vector<LogRecord<T> > chunk(4096);
+        while (true)
+        {
+            got = ::pread(fd, chunk.data(), chunk.size() * sizeof(LogRecord<T>), offset);
+            if (got < 0)
+            {
+                throw std::runtime_error( "Cannot read log " + path );
+            }
+
+            std::size_t numWhole = static_cast<std::size_t>(got) / sizeof(LogRecord<T>);
+            for (std::size_t ii = 0; ii < numWhole; ++ii)
+            {
+                const LogRecord<T>& record = chunk[ii];
+                if (checksum32(&record.m_op, sizeof(record) - sizeof(record.m_checksum)) != record.m_checksum ||
+                    record.m_op < LOG_INSERT || record.m_op > LOG_CLEAR)
+                {
+                    return cutTail(fd, path, offset, numReplayed);
+                }
+                apply(static_cast<LogOp>(record.m_op), record.m_key);
+                offset += sizeof(LogRecord<T>);
+                ++numReplayed;
+            }
+            if (numWhole < chunk.size())
+            {
+                // anything left over is a partial record
+                return cutTail(fd, path, offset, numReplayed);
+            }
+        }
+    }
+
+    static std::size_t cutTail(int fd, const std::string& path, std::uint64_t end, std::size_t numReplayed)
+    {
+        struct stat info;
+        if (::fstat(fd, &info) != 0)
+        {
+            throw std::runtime_error( "Cannot read log " + path );
+        }
+        if (static_cast<std::uint64_t>(info.st_size) > end &&
+            (::ftruncate(fd, end) != 0 || ::fdatasync(fd) != 0))
+        {
+            throw std::runtime_error( "Cannot cut the torn end off log " + path );
+        }
+        return numReplayed;
+    }
+
+    bool writeAll(const char* bytes, std::size_t length) const
+    {
+        return writeAll(m_fd, bytes, length);
+    }
+
+    static bool writeAll(int fd, const char* bytes, std::size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t written = ::write(fd, bytes, length);
+            if (written <= 0)
+            {
+                return false;
+            }
+            bytes += written;
+            length -= written;
+        }
+        return true;
+    }
+};
+
+#endif